@@ -1,12 +1,23 @@
 /*
 Use this to compile:
-g++ --std=c++17 JoonasImageEditor.cpp -o JoonasImageEditor -W -Wall -pedantic `pkg-config gtkmm-3.0 --cflags --libs`
+g++ --std=c++17 -O2 -pthread JoonasImageEditor.cpp -o JoonasImageEditor -W -Wall -pedantic `pkg-config gtkmm-3.0 --cflags --libs`
+
+Recording inputs and replaying them for timing (see replay_events below for details):
+JoonasImageEditor --record FILE
+xvfb-run JoonasImageEditor --replay FILE [--report FILE] [--budget-us MICROSECONDS] [--expect-hash HASH]
+
+Headless batch transform (no window is opened, any number of operations is applied in order):
+JoonasImageEditor --batch INPUT OUTPUT [flipx] [flipy] [rot90] [rot270] [rotate=DEGREES] [scale=FACTOR] [scale=WIDTHxHEIGHT]
+
+Headless delta animation export (the images must all have the same size):
+JoonasImageEditor --delta OUTPUT INPUT1 INPUT2 [INPUT3 ...]
 
 File formats in my image editor:
 .VGA: 64,000-byte 320 x 200 VGA picture file without image size and palette info
 .PAL: 768-byte VGA palette file
 .IMG: 64,768-byte 320 x 200 VGA picture file without image size and with palette info (found at the end of the file)
 .PIC: VGA image file. The 4-byte header determines the width & height of the image. The first 2 bytes indicate the width, the next 2 bytes the height.
+.DLT: Delta animation, written by "File -> Export Delta Animation..." and --delta. See encode_delta_frame below.
 
 As VGA RGB values can be in the range 0 ... 63, that means that each VGA palette entry uses 6 bits per color value.
 If I want to make my palette files even smaller in the future, I could make use of the 6-bit thing so that
@@ -19,6 +30,27 @@ each VGA palette color takes 3 * 6 bits = 18 bits per VGA palette color, 18 bits
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <cstdarg>
+#include <sstream>
+#include <chrono>
+#include <memory>
 
 #define pixel_size 2 // Size (width and height) of each pixel of the VGA screen
 #define drawingAreaWidth 700
@@ -34,14 +66,40 @@ each VGA palette color takes 3 * 6 bits = 18 bits per VGA palette color, 18 bits
 #define FILE_EXTENSION_PAL 1
 #define FILE_EXTENSION_VGA 2
 #define FILE_EXTENSION_PIC 3
+#define FILE_EXTENSION_IMG 4
 #define gtk_menu_append(menu,child) gtk_menu_shell_append  ((GtkMenuShell *)(menu),(child))
 #define DISABLED_AREA_OF_DRAWINGAREA_COLOR_R 78
 #define DISABLED_AREA_OF_DRAWINGAREA_COLOR_G 78
 #define DISABLED_AREA_OF_DRAWINGAREA_COLOR_B 60
-
-char * loadedFile = (char*) malloc(256000); // Loaded 320 x 200 image, which can be eg. BMP, PNG, JPG or a 256-color VGA picture file which uses my own file extension and file format.
-char * loadedPalette = (char*) malloc(768);
-unsigned int loadedSize = 64000; // Upon starting the program, the image is a blank 320x200 VGA picture, which makes the filesize of the file to save 64000 bytes.
+#define BRUSH_SHAPE_ROUND 1
+#define BRUSH_SHAPE_SQUARE 2
+#define BRUSH_SHAPE_STAMP 3
+#define max_brush_size 64 // Maximum width and height of the round and square brushes
+#define number_of_brush_patterns 6
+#define TOOL_DRAW 1
+#define TOOL_SELECT 2
+#define SELECTION_DRAG_NONE 0
+#define SELECTION_DRAG_CREATE 1
+#define SELECTION_DRAG_MOVE 2
+#define TRANSFORM_FLIP_HORIZONTAL 1
+#define TRANSFORM_FLIP_VERTICAL 2
+#define TRANSFORM_ROTATE_CLOCKWISE 3
+#define TRANSFORM_ROTATE_COUNTERCLOCKWISE 4
+#define TRANSFORM_ROTATE_ANGLE 5
+#define TRANSFORM_SCALE 6
+#define parallel_transform_threshold 262144 // Images with at least this many pixels are transformed on several threads
+#define max_image_pixels 16777216 // Larger images (in pixels) are refused when loading, resizing or transforming
+#define thumbnail_width 80 // Size of the thumbnails of the asset browser
+#define thumbnail_height 50
+#define thumbnail_memory_cache_size 2048 // How many thumbnails are kept in memory
+#define thumbnail_disk_cache_size 20000 // How many thumbnail files are kept on disk
+#define THUMBNAIL_QUEUED 0
+#define THUMBNAIL_DECODING 1
+#define THUMBNAIL_DONE 2
+#define live_reload_delay 200 // Milliseconds without changes before an externally modified file is reloaded
+#define pool_minimum_size_class 12 // The smallest pooled buffer is 4 KB
+#define pool_buffers_per_size_class 8 // How many unused buffers of each size the pool keeps
+#define delta_playback_frame_rate 70 // Frames per second used for the bandwidth figure of the delta export report
 
 static cairo_surface_t *surface = NULL;
 
@@ -51,28 +109,262 @@ GtkWidget *widthField;
 GtkWidget *heightField;
 GtkWidget *sourceColorField;
 GtkWidget *targetColorField;
+GtkWidget *brushSizeField;
+GtkWidget *transparentColorField;
+GtkWidget *transformField;
+GtkWidget *documentSelector;
+GtkWidget *drawToolMenuItem;
+GtkWidget *selectToolMenuItem;
+GtkWidget *brushShapeMenuItems[3]; // Indexed by BRUSH_SHAPE_ - BRUSH_SHAPE_ROUND
+GtkWidget *brushPatternMenuItems[number_of_brush_patterns];
 
 GdkPixbuf *pixbuf;
 
 guchar data[size_of_interaction_window];
 
-unsigned char VGA_screen[64000]; // The 320x200 VGA screen that is used to draw on.
+unsigned int palette_usage[256]; // How many pixels of the image use each palette index
 
 /*
  The palette registers array should contain RGB colors in the 8-bit BGR format (R, G and B can have the value 0 ... 255).
  Remember that when saving a .PAL palette file, the saved values should be in the VGA 6-bit RGB format (R, G and B can have the value 0 ... 63).
  Likewise, when loading a .PAL palette file, the VGA 6-bit RGB values in it should be converted to the 8-bit RGB format.
 */
-int VGA_palette_registers[768] =
+const uint8_t default_VGA_palette_registers[768] =
 {
 0x00,0x00,0x00,0x00,0x00,0xAA,0x00,0xAA,0x00,0x00,0xAA,0xAA,0xAA,0x00,0x00,0xAA,0x00,0xAA,0xAA,0x55,0x00,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0xFF,0x55,0xFF,0x55,0x55,0xFF,0xFF,0xFF,0x55,0x55,0xFF,0x55,0xFF,0xFF,0xFF,0x55,0xFF,0xFF,0xFF,0x00,0x00,0x00,0x14,0x14,0x14,0x20,0x20,0x20,0x2C,0x2C,0x2C,0x38,0x38,0x38,0x45,0x45,0x45,0x51,0x51,0x51,0x61,0x61,0x61,0x71,0x71,0x71,0x82,0x82,0x82,0x92,0x92,0x92,0xA2,0xA2,0xA2,0xB6,0xB6,0xB6,0xCB,0xCB,0xCB,0xE3,0xE3,0xE3,0xFF,0xFF,0xFF,0x00,0x00,0xFF,0x41,0x00,0xFF,0x7D,0x00,0xFF,0xBE,0x00,0xFF,0xFF,0x00,0xFF,0xFF,0x00,0xBE,0xFF,0x00,0x7D,0xFF,0x00,0x41,0xFF,0x00,0x00,0xFF,0x41,0x00,0xFF,0x7D,0x00,0xFF,0xBE,0x00,0xFF,0xFF,0x00,0xBE,0xFF,0x00,0x7D,0xFF,0x00,0x41,0xFF,0x00,0x00,0xFF,0x00,0x00,0xFF,0x41,0x00,0xFF,0x7D,0x00,0xFF,0xBE,0x00,0xFF,0xFF,0x00,0xBE,0xFF,0x00,0x7D,0xFF,0x00,0x41,0xFF,0x7D,0x7D,0xFF,0x9E,0x7D,0xFF,0xBE,0x7D,0xFF,0xDF,0x7D,0xFF,0xFF,0x7D,0xFF,0xFF,0x7D,0xDF,0xFF,0x7D,0xBE,0xFF,0x7D,0x9E,0xFF,0x7D,0x7D,0xFF,0x9E,0x7D,0xFF,0xBE,0x7D,0xFF,0xDF,0x7D,0xFF,0xFF,0x7D,0xDF,0xFF,0x7D,0xBE,0xFF,0x7D,0x9E,0xFF,0x7D,0x7D,0xFF,0x7D,0x7D,0xFF,0x9E,0x7D,0xFF,0xBE,0x7D,0xFF,0xDF,0x7D,0xFF,0xFF,0x7D,0xDF,0xFF,0x7D,0xBE,0xFF,0x7D,0x9E,0xFF,0xB6,0xB6,0xFF,0xC7,0xB6,0xFF,0xDB,0xB6,0xFF,0xEB,0xB6,0xFF,0xFF,0xB6,0xFF,0xFF,0xB6,0xEB,0xFF,0xB6,0xDB,0xFF,0xB6,0xC7,0xFF,0xB6,0xB6,0xFF,0xC7,0xB6,0xFF,0xDB,0xB6,0xFF,0xEB,0xB6,0xFF,0xFF,0xB6,0xEB,0xFF,0xB6,0xDB,0xFF,0xB6,0xC7,0xFF,0xB6,0xB6,0xFF,0xB6,0xB6,0xFF,0xC7,0xB6,0xFF,0xDB,0xB6,0xFF,0xEB,0xB6,0xFF,0xFF,0xB6,0xEB,0xFF,0xB6,0xDB,0xFF,0xB6,0xC7,0xFF,0x00,0x00,0x71,0x1C,0x00,0x71,0x38,0x00,0x71,0x55,0x00,0x71,0x71,0x00,0x71,0x71,0x00,0x55,0x71,0x00,0x38,0x71,0x00,0x1C,0x71,0x00,0x00,0x71,0x1C,0x00,0x71,0x38,0x00,0x71,0x55,0x00,0x71,0x71,0x00,0x55,0x71,0x00,0x38,0x71,0x00,0x1C,0x71,0x00,0x00,0x71,0x00,0x00,0x71,0x1C,0x00,0x71,0x38,0x00,0x71,0x55,0x00,0x71,0x71,0x00,0x55,0x71,0x00,0x38,0x71,0x00,0x1C,0x71,0x38,0x38,0x71,0x45,0x38,0x71,0x55,0x38,0x71,0x61,0x38,0x71,0x71,0x38,0x71,0x71,0x38,0x61,0x71,0x38,0x55,0x71,0x38,0x45,0x71,0x38,0x38,0x71,0x45,0x38,0x71,0x55,0x38,0x71,0x61,0x38,0x71,0x71,0x38,0x61,0x71,0x38,0x55,0x71,0x38,0x45,0x71,0x38,0x38,0x71,0x38,0x38,0x71,0x45,0x38,0x71,0x55,0x38,0x71,0x61,0x38,0x71,0x71,0x38,0x61,0x71,0x38,0x55,0x71,0x38,0x45,0x71,0x51,0x51,0x71,0x59,0x51,0x71,0x61,0x51,0x71,0x69,0x51,0x71,0x71,0x51,0x71,0x71,0x51,0x69,0x71,0x51,0x61,0x71,0x51,0x59,0x71,0x51,0x51,0x71,0x59,0x51,0x71,0x61,0x51,0x71,0x69,0x51,0x71,0x71,0x51,0x69,0x71,0x51,0x61,0x71,0x51,0x59,0x71,0x51,0x51,0x71,0x51,0x51,0x71,0x59,0x51,0x71,0x61,0x51,0x71,0x69,0x51,0x71,0x71,0x51,0x69,0x71,0x51,0x61,0x71,0x51,0x59,0x71,0x00,0x00,0x41,0x10,0x00,0x41,0x20,0x00,0x41,0x30,0x00,0x41,0x41,0x00,0x41,0x41,0x00,0x30,0x41,0x00,0x20,0x41,0x00,0x10,0x41,0x00,0x00,0x41,0x10,0x00,0x41,0x20,0x00,0x41,0x30,0x00,0x41,0x41,0x00,0x30,0x41,0x00,0x20,0x41,0x00,0x10,0x41,0x00,0x00,0x41,0x00,0x00,0x41,0x10,0x00,0x41,0x20,0x00,0x41,0x30,0x00,0x41,0x41,0x00,0x30,0x41,0x00,0x20,0x41,0x00,0x10,0x41,0x20,0x20,0x41,0x28,0x20,0x41,0x30,0x20,0x41,0x38,0x20,0x41,0x41,0x20,0x41,0x41,0x20,0x38,0x41,0x20,0x30,0x41,0x20,0x28,0x41,0x20,0x20,0x41,0x28,0x20,0x41,0x30,0x20,0x41,0x38,0x20,0x41,0x41,0x20,0x38,0x41,0x20,0x30,0x41,0x20,0x28,0x41,0x20,0x20,0x41,0x20,0x20,0x41,0x28,0x20,0x41,0x30,0x20,0x41,0x38,0x20,0x41,0x41,0x20,0x38,0x41,0x20,0x30,0x41,0x20,0x28,0x41,0x2C,0x2C,0x41,0x30,0x2C,0x41,0x34,0x2C,0x41,0x3C,0x2C,0x41,0x41,0x2C,0x41,0x41,0x2C,0x3C,0x41,0x2C,0x34,0x41,0x2C,0x30,0x41,0x2C,0x2C,0x41,0x30,0x2C,0x41,0x34,0x2C,0x41,0x3C,0x2C,0x41,0x41,0x2C,0x3C,0x41,0x2C,0x34,0x41,0x2C,0x30,0x41,0x2C,0x2C,0x41,0x2C,0x2C,0x41,0x30,0x2C,0x41,0x34,0x2C,0x41,0x3C,0x2C,0x41,0x41,0x2C,0x3C,0x41,0x2C,0x34,0x41,0x2C,0x30,0x41,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00
 };
 
+/*
+ Pool of pixel buffers. Buffers are handed out in power-of-two size classes and come back to the pool when the
+ PooledBuffer that holds them is destroyed, so opening and closing images keeps reusing the same memory.
+ The thumbnail workers use the pool too, so it is guarded by a mutex.
+*/
+class BufferPool {
+public:
+	BufferPool() {
+		for(int sizeClass = 0; sizeClass < 40; sizeClass++) free_buffers[sizeClass].reserve(pool_buffers_per_size_class);
+	}
+
+	~BufferPool() {
+		for(int sizeClass = 0; sizeClass < 40; sizeClass++) {
+			for(unsigned int buffer = 0; buffer < free_buffers[sizeClass].size(); buffer++) free(free_buffers[sizeClass][buffer]);
+		}
+	}
+
+	// Returns NULL if the memory can't be allocated.
+	unsigned char *acquire(size_t size, int &sizeClass) {
+		sizeClass = pool_minimum_size_class;
+		while(sizeClass < 40 && ((size_t) 1 << sizeClass) < size) sizeClass++;
+		if(sizeClass == 40) return NULL;
+		std::lock_guard<std::mutex> lock(mutex);
+		if(free_buffers[sizeClass].empty()) return (unsigned char*) malloc((size_t) 1 << sizeClass);
+		unsigned char *buffer = free_buffers[sizeClass].back();
+		free_buffers[sizeClass].pop_back();
+		return buffer;
+	}
+
+	void release(unsigned char *buffer, int sizeClass) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if(free_buffers[sizeClass].size() < pool_buffers_per_size_class) free_buffers[sizeClass].push_back(buffer);
+		else free(buffer);
+	}
+
+private:
+	std::mutex mutex;
+	std::vector<unsigned char*> free_buffers[40]; // Indexed by size class, the buffers of class n are 2^n bytes
+};
+
+BufferPool buffer_pool;
+
+// A buffer from buffer_pool that is given back when the PooledBuffer is destroyed.
+class PooledBuffer {
+public:
+	PooledBuffer() : buffer(NULL), length(0), sizeClass(0) {}
+	PooledBuffer(const PooledBuffer&) = delete;
+	PooledBuffer &operator=(const PooledBuffer&) = delete;
+
+	~PooledBuffer() {
+		if(buffer != NULL) buffer_pool.release(buffer, sizeClass);
+	}
+
+	// Makes room for size bytes. The old contents are not kept if a larger buffer is needed.
+	// Returns false if there isn't enough memory, and the buffer is then empty.
+	bool resize(size_t size) {
+		if(buffer == NULL || size > ((size_t) 1 << sizeClass)) {
+			if(buffer != NULL) buffer_pool.release(buffer, sizeClass);
+			buffer = buffer_pool.acquire(size, sizeClass);
+		}
+		length = (buffer != NULL) ? size : 0;
+		return buffer != NULL;
+	}
+
+	void swap(PooledBuffer &other) {
+		std::swap(buffer, other.buffer);
+		std::swap(length, other.length);
+		std::swap(sizeClass, other.sizeClass);
+	}
+
+	unsigned char *data() { return buffer; }
+	const unsigned char *data() const { return buffer; }
+	size_t size() const { return length; }
+
+private:
+	unsigned char *buffer;
+	size_t length;
+	int sizeClass;
+};
+
+/*
+ An open image: its pixels (width bytes per row) and its palette (8-bit RGB values, like VGA_palette_registers).
+ The pixels come from buffer_pool and go back there when the document is closed.
+*/
+class Document {
+public:
+	Document(int documentWidth, int documentHeight, const std::string &documentName) : width(documentWidth), height(documentHeight), name(documentName),
+		imageWatch(-1), paletteWatch(-1), imageReloadPending(false), paletteReloadPending(false) {
+		if(pixels.resize((size_t) width * height)) memset(pixels.data(), 0, (size_t) width * height);
+		else width = height = 0;
+		memcpy(palette, default_VGA_palette_registers, 768);
+	}
+
+	/*
+	 Replaces the image with a copy of the given pixels. The buffer is only exchanged if the new image doesn't fit in it.
+	 Returns false, and leaves the image as it was, if there isn't enough memory.
+	*/
+	bool replace(const unsigned char *src, int newWidth, int newHeight) {
+		PooledBuffer replaced;
+		if((size_t) newWidth * newHeight > pixels.size() && !replaced.resize((size_t) newWidth * newHeight)) return false;
+		if(replaced.data() != NULL) pixels.swap(replaced);
+		else pixels.resize((size_t) newWidth * newHeight);
+		memcpy(pixels.data(), src, (size_t) newWidth * newHeight);
+		width = newWidth;
+		height = newHeight;
+		return true;
+	}
+
+	/*
+	 Changes the size of the image. The pixels that fit in both sizes are kept, the new pixels get the color fill.
+	 Returns false, and leaves the image as it was, if there isn't enough memory.
+	*/
+	bool resize(int newWidth, int newHeight, int fill) {
+		PooledBuffer resized;
+		if(!resized.resize((size_t) newWidth * newHeight)) return false;
+		for(int y = 0; y < newHeight; y++) {
+			unsigned char *row = resized.data() + ((size_t) y * newWidth);
+			int kept = (y < height) ? std::min(width, newWidth) : 0;
+			if(kept > 0) memcpy(row, pixels.data() + ((size_t) y * width), kept);
+			memset(row + kept, fill, newWidth - kept);
+		}
+		pixels.swap(resized);
+		width = newWidth;
+		height = newHeight;
+		return true;
+	}
+
+	int width;
+	int height;
+	PooledBuffer pixels;
+	uint8_t palette[768];
+	std::string name; // Shown in the document selector
+	std::string imagePath; // The image file that was opened into this document, empty if none
+	std::string palettePath; // The palette file that was opened into this document, empty if none
+	int imageWatch; // inotify watch descriptors of the directories of imagePath and palettePath, -1 if none
+	int paletteWatch;
+	bool imageReloadPending; // The file has changed and is reloaded after live_reload_delay, or when the document is shown again
+	bool paletteReloadPending;
+};
+
+std::vector<std::unique_ptr<Document>> documents; // All open documents
+Document *document = NULL; // The document that is being edited
+unsigned char *VGA_screen = NULL; // Pixels of the current document, imageWidth bytes per row. The top left 320x200 pixels are shown.
+uint8_t *VGA_palette_registers = NULL; // Palette of the current document
+bool switching_document = false; // Set while the document selector is changed by the program and not by the user
+
 int brush1_color = 1; // VGA palette index value of currently selected color for brush 1 (left mouse button)
 int brush2_color = 2; // VGA palette index value of currently selected color for brush 2 (right mouse button)
 int imageWidth = 320; // Current width of image
 int imageHeight = 200; // Current height of image
 
+// Makes doc the document that is edited. Call this again whenever the pixel buffer of the document changes.
+void bind_document(Document *doc) {
+	document = doc;
+	VGA_screen = doc->pixels.data();
+	VGA_palette_registers = doc->palette;
+	imageWidth = doc->width;
+	imageHeight = doc->height;
+}
+
+int brush_size = 1; // Width and height of the round and square brushes in VGA pixels
+int brush_shape = BRUSH_SHAPE_ROUND;
+int brush_pattern = 0; // Index into brush_patterns
+int transparent_color = 0; // VGA palette index that is not drawn when stamping a custom brush or placing a floating selection
+int brush_span_start[max_brush_size]; // First column of each row of the round brush
+int brush_span_end[max_brush_size]; // Last column of each row of the round brush
+unsigned char brush_stamp[64000]; // Custom brush, captured from the image
+int brush_stamp_width = 0;
+int brush_stamp_height = 0;
+int stroke_last_x = -1; // VGA coordinate where the brush was last stamped during the current stroke
+int stroke_last_y = -1;
+
+int current_tool = TOOL_DRAW;
+bool selection_active = false; // Is there a selection rectangle
+bool selection_floating = false; // Have the selected pixels been lifted off the image into floating_pixels
+int selection_x = 0; // Position and size of the selection in VGA pixels. A floating selection may extend outside the image.
+int selection_y = 0;
+int selection_width = 0;
+int selection_height = 0;
+int selection_drag = SELECTION_DRAG_NONE;
+int drag_anchor_x = 0; // Where a new selection was started, or where the floating selection was grabbed relative to its corner
+int drag_anchor_y = 0;
+unsigned char floating_pixels[64000]; // The selected pixels while the selection is being moved or pasted
+unsigned char clipboard_pixels[64000];
+int clipboard_width = 0;
+int clipboard_height = 0;
+
+/*
+ 8x8 fill patterns for the brush, one byte per row. The most significant bit is the leftmost pixel.
+ The patterns are anchored to the image so that overlapping stamps line up seamlessly.
+*/
+unsigned char brush_patterns[number_of_brush_patterns][8] = {
+	{ 0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF }, // Solid
+	{ 0xAA,0x55,0xAA,0x55,0xAA,0x55,0xAA,0x55 }, // Checkerboard
+	{ 0xFF,0x00,0xFF,0x00,0xFF,0x00,0xFF,0x00 }, // Horizontal lines
+	{ 0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA }, // Vertical lines
+	{ 0x80,0x40,0x20,0x10,0x08,0x04,0x02,0x01 }, // Diagonal lines
+	{ 0x88,0x00,0x22,0x00,0x88,0x00,0x22,0x00 }  // Sparse dots
+};
+
+/*
+ Input recording
+
+ With --record FILE, every input that changes the image is written to FILE as one line: the time in microseconds
+ since the start of the recording, the type of the input and its values. See replay_events() for playing it back.
+*/
+std::ofstream record_file;
+gint64 record_start_time = 0;
+bool replaying = false;
+
+void record_event(const char *format, ...) {
+	if(!record_file.is_open() || replaying) return;
+	char line[1024];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	record_file << (long long)(g_get_monotonic_time() - record_start_time) << " " << line << "\n";
+}
+
+bool setting_sliders = false; // Set while the program moves the sliders, so that it isn't recorded as slider input
+
+// Moves the sliders to the RGB values of a palette color.
+void set_sliders_to_color(int color_index) {
+	setting_sliders = true;
+	gtk_range_set_value(GTK_RANGE (slider), (VGA_palette_registers[(color_index * 3) + 0] / 4));
+	gtk_range_set_value(GTK_RANGE (slider2), (VGA_palette_registers[(color_index * 3) + 1] / 4));
+	gtk_range_set_value(GTK_RANGE (slider3), (VGA_palette_registers[(color_index * 3) + 2] / 4));
+	setting_sliders = false;
+}
+
 void put_palette_square_to_screen(int x, int y, int VGA_palette_index_color) {
 	guchar palette_square_gfx[size_of_palette_square * 3 * size_of_palette_square] = {
 	0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,0x7F,
@@ -179,13 +471,14 @@ draw_cb (GtkWidget *widget,
 	return FALSE;
 }
 
+void stop_thumbnail_workers(); // Part of the asset browser, see below
+
 static void
 close_window (void)
 {
 
 	std::cout << "Quitting program." << std::endl;
-	free(loadedFile);
-	free(loadedPalette);
+	stop_thumbnail_workers();
 
 	if (surface)
 		cairo_surface_destroy (surface);
@@ -193,37 +486,6 @@ close_window (void)
 	gtk_main_quit ();
 }
 
-void put_vga_picture_to_screen() {
-	int xpos = 0;
-	int ypos = 0;
-	for(int pos = 0; pos < 64000; pos++)
-	{
-		int VGA_palette_index = VGA_screen[pos];
-		if(VGA_palette_index < 0) VGA_palette_index += 256;
-		int Rvalue = VGA_palette_registers[(VGA_palette_index * 3) + 0];
-		int Gvalue = VGA_palette_registers[(VGA_palette_index * 3) + 1];
-		int Bvalue = VGA_palette_registers[(VGA_palette_index * 3) + 2];
-
-		// Put the pixel to the image area.
-		for(int squareY = 0; squareY < pixel_size; squareY++)
-		{
-			for(int squareX = 0; squareX < pixel_size; squareX++)
-			{
-				data[(ypos * pixel_size * drawingAreaRowStride) + (squareY * drawingAreaRowStride) + (xpos * pixel_size * 3) + (squareX * 3) + 0] = Rvalue;
-				data[(ypos * pixel_size * drawingAreaRowStride) + (squareY * drawingAreaRowStride) + (xpos * pixel_size * 3) + (squareX * 3) + 1] = Gvalue;
-				data[(ypos * pixel_size * drawingAreaRowStride) + (squareY * drawingAreaRowStride) + (xpos * pixel_size * 3) + (squareX * 3) + 2] = Bvalue;
-			}
-		}
-		xpos++;
-		if(xpos >= 320)
-		{
-			xpos = 0;
-			ypos++;
-		}
-	}
-	gtk_widget_queue_draw_area (da, 0, 0, drawingAreaWidth, drawingAreaHeight);
-}
-
 void put_pixel(int colorR, int colorG, int colorB, int x, int y) {
 	int actualX = (x / pixel_size) * pixel_size;
 	int actualY = (y / pixel_size) * pixel_size;
@@ -239,14 +501,509 @@ void put_pixel(int colorR, int colorG, int colorB, int x, int y) {
 	}
 }
 
-void draw_brush(int vga_pixel, int colorR, int colorG, int colorB, int x, int y) {
-	int dpos = ((y / pixel_size) * 320) + (x / pixel_size);
-	VGA_screen[dpos] = vga_pixel;
+/*
+ Converts the VGA pixels x0 ... x1 of row y to RGB and puts them to the image area. src points to the palette index of pixel x0.
+ Only the first display row of the span is built pixel by pixel, the other rows of the pixel_size tall row are copied from it.
+ The part of the span that is outside of the 320x200 VGA screen isn't shown.
+*/
+void put_indexed_span_to_screen(const unsigned char *src, int x0, int x1, int y) {
+	if(y >= 200) return;
+	if(x1 > 319) x1 = 319;
+	if(x0 > x1) return;
+	guchar *row = data + (y * pixel_size * drawingAreaRowStride) + (x0 * pixel_size * 3);
+	guchar *out = row;
+	for(int x = x0; x <= x1; x++)
+	{
+		const uint8_t *rgb = &VGA_palette_registers[src[x - x0] * 3];
+		for(int squareX = 0; squareX < pixel_size; squareX++)
+		{
+			*out++ = rgb[0];
+			*out++ = rgb[1];
+			*out++ = rgb[2];
+		}
+	}
+	int rowBytes = out - row;
+	for(int squareY = 1; squareY < pixel_size; squareY++)
+	{
+		memcpy(row + (squareY * drawingAreaRowStride), row, rowBytes);
+	}
+}
 
-	put_pixel(colorR, colorG, colorB, x, y);
-	int actualX = (x / pixel_size) * pixel_size;
-	int actualY = (y / pixel_size) * pixel_size;
-	gtk_widget_queue_draw_area (da, actualX, actualY, pixel_size, pixel_size);
+void put_vga_span_to_screen(int x0, int x1, int y) {
+	put_indexed_span_to_screen(VGA_screen + ((size_t) y * imageWidth) + x0, x0, x1, y);
+}
+
+/*
+ Copies one row of pixels, leaving the destination pixel untouched wherever the source pixel has the transparent color.
+ The loop has no branches that the compiler couldn't turn into a vector blend.
+*/
+void blit_masked_row(unsigned char *dst, const unsigned char *src, int length, int transparent) {
+	for(int x = 0; x < length; x++) {
+		unsigned char pixel = src[x];
+		dst[x] = (pixel == transparent) ? dst[x] : pixel;
+	}
+}
+
+// Puts one pixel of the dashed selection outline to the image area. dx and dy are coordinates of the image area, not VGA pixels.
+void put_outline_pixel(int dx, int dy) {
+	guchar value = (((dx + dy) / 4) & 1) ? 0xFF : 0x00;
+	data[(dy * drawingAreaRowStride) + (dx * 3) + 0] = value;
+	data[(dy * drawingAreaRowStride) + (dx * 3) + 1] = value;
+	data[(dy * drawingAreaRowStride) + (dx * 3) + 2] = value;
+}
+
+// Draws the part of the selection outline that falls inside the VGA pixels left ... right, top ... bottom of the image.
+void put_selection_outline(int left, int top, int right, int bottom) {
+	if(right >= imageWidth) right = imageWidth - 1;
+	if(bottom >= imageHeight) bottom = imageHeight - 1;
+	int clipX0 = left * pixel_size;
+	int clipY0 = top * pixel_size;
+	int clipX1 = ((right + 1) * pixel_size) - 1;
+	int clipY1 = ((bottom + 1) * pixel_size) - 1;
+	int outlineX0 = selection_x * pixel_size;
+	int outlineY0 = selection_y * pixel_size;
+	int outlineX1 = ((selection_x + selection_width) * pixel_size) - 1;
+	int outlineY1 = ((selection_y + selection_height) * pixel_size) - 1;
+
+	for(int dx = (outlineX0 > clipX0 ? outlineX0 : clipX0); dx <= (outlineX1 < clipX1 ? outlineX1 : clipX1); dx++) {
+		if(outlineY0 >= clipY0 && outlineY0 <= clipY1) put_outline_pixel(dx, outlineY0);
+		if(outlineY1 >= clipY0 && outlineY1 <= clipY1) put_outline_pixel(dx, outlineY1);
+	}
+	for(int dy = (outlineY0 > clipY0 ? outlineY0 : clipY0); dy <= (outlineY1 < clipY1 ? outlineY1 : clipY1); dy++) {
+		if(outlineX0 >= clipX0 && outlineX0 <= clipX1) put_outline_pixel(outlineX0, dy);
+		if(outlineX1 >= clipX0 && outlineX1 <= clipX1) put_outline_pixel(outlineX1, dy);
+	}
+}
+
+/*
+ Puts an area of the VGA screen to the image area, with the floating selection on top of it and the selection outline around it.
+ The area is given in VGA pixels and clipped to the 320x200 VGA screen. The part of the VGA screen that is outside of the image
+ gets the disabled area color. It isn't queued for drawing.
+*/
+void put_vga_rect_to_screen(int x, int y, int width, int height) {
+	int left = (x < 0) ? 0 : x;
+	int top = (y < 0) ? 0 : y;
+	int right = (x + width > 320) ? 319 : x + width - 1;
+	int bottom = (y + height > 200) ? 199 : y + height - 1;
+	if(left > right || top > bottom) return;
+	int imageRight = (right < imageWidth) ? right : imageWidth - 1;
+
+	unsigned char composed[320];
+	for(int ypos = top; ypos <= bottom; ypos++) {
+		int disabledLeft = left;
+		if(ypos < imageHeight && left <= imageRight) {
+			const unsigned char *src = VGA_screen + ((size_t) ypos * imageWidth) + left;
+			if(selection_floating && ypos >= selection_y && ypos < selection_y + selection_height) {
+				int floatX0 = (selection_x > left) ? selection_x : left;
+				int floatX1 = selection_x + selection_width - 1;
+				if(floatX1 > imageRight) floatX1 = imageRight;
+				if(floatX0 <= floatX1) {
+					memcpy(composed, src, imageRight - left + 1);
+					blit_masked_row(composed + (floatX0 - left), floating_pixels + ((ypos - selection_y) * selection_width) + (floatX0 - selection_x), floatX1 - floatX0 + 1, transparent_color);
+					src = composed;
+				}
+			}
+			put_indexed_span_to_screen(src, left, imageRight, ypos);
+			disabledLeft = imageRight + 1;
+		}
+		for(int xpos = disabledLeft; xpos <= right; xpos++) {
+			put_pixel(DISABLED_AREA_OF_DRAWINGAREA_COLOR_R, DISABLED_AREA_OF_DRAWINGAREA_COLOR_G, DISABLED_AREA_OF_DRAWINGAREA_COLOR_B, xpos * pixel_size, ypos * pixel_size);
+		}
+	}
+	if(selection_active) put_selection_outline(left, top, right, bottom);
+}
+
+void queue_vga_rect(int x, int y, int width, int height) {
+	gtk_widget_queue_draw_area (da, x * pixel_size, y * pixel_size, width * pixel_size, height * pixel_size);
+}
+
+void put_vga_picture_to_screen() {
+	put_vga_rect_to_screen(0, 0, 320, 200);
+	gtk_widget_queue_draw_area (da, 0, 0, drawingAreaWidth, drawingAreaHeight);
+}
+
+
+/*
+ Palette usage
+
+ palette_usage holds the number of pixels of the image (imageWidth x imageHeight) that use each palette index.
+ Everything that writes to VGA_screen keeps it up to date, so it never has to be counted from the whole image
+ except when the size of the image changes.
+*/
+#define rare_color_threshold 16 // Colors used by at most this many pixels are reported as rarely used
+#define histogram_width 512
+#define histogram_height 128
+
+GtkWidget *histogramWindow = NULL;
+GtkWidget *histogramArea;
+GtkWidget *histogramReport;
+guint histogram_report_timer = 0;
+
+// Adds amount (1 or -1) to the usage counts of the given pixels.
+void add_palette_usage(const unsigned char *pixels, int length, int amount) {
+	for(int x = 0; x < length; x++) {
+		palette_usage[pixels[x]] += amount;
+	}
+}
+
+void count_palette_usage() {
+	memset(palette_usage, 0, sizeof(palette_usage));
+	for(int y = 0; y < imageHeight; y++) {
+		add_palette_usage(VGA_screen + ((size_t) y * imageWidth), imageWidth, 1);
+	}
+}
+
+gboolean update_histogram_report(gpointer user_data) {
+	histogram_report_timer = 0;
+	if(histogramWindow == NULL) return FALSE;
+	std::string unused;
+	std::string rare;
+	int unusedCount = 0;
+	for(int index = 0; index < 256; index++) {
+		if(palette_usage[index] == 0) {
+			unused += " " + std::to_string(index);
+			unusedCount++;
+		}
+		else if(palette_usage[index] <= rare_color_threshold) {
+			rare += " " + std::to_string(index) + " (" + std::to_string(palette_usage[index]) + ")";
+		}
+	}
+	std::string report = "Unused colors (" + std::to_string(unusedCount) + "):" + unused + "\nColors used by at most " + std::to_string(rare_color_threshold) + " pixels:" + rare;
+	gtk_label_set_text(GTK_LABEL (histogramReport), report.c_str());
+	return FALSE;
+}
+
+// Call this after changing palette_usage. The histogram is redrawn right away, the text report a moment later.
+void palette_usage_changed() {
+	if(histogramWindow == NULL) return;
+	gtk_widget_queue_draw(histogramArea);
+	if(histogram_report_timer == 0) histogram_report_timer = g_timeout_add(250, update_histogram_report, NULL);
+}
+
+// One bar per palette index, in the color of the index. The heights are logarithmic so that rarely used colors are visible too.
+static gboolean
+histogram_draw_cb (GtkWidget *widget,
+         cairo_t   *cr,
+         gpointer   data)
+{
+	unsigned int maxUsage = 1;
+	for(int index = 0; index < 256; index++) {
+		if(palette_usage[index] > maxUsage) maxUsage = palette_usage[index];
+	}
+	cairo_set_source_rgb (cr, 0.5, 0.5, 0.5);
+	cairo_paint (cr);
+	double barWidth = histogram_width / 256.0;
+	for(int index = 0; index < 256; index++) {
+		if(palette_usage[index] == 0) continue;
+		double barHeight = 1 + ((histogram_height - 1) * log(1.0 + palette_usage[index]) / log(1.0 + maxUsage));
+		cairo_set_source_rgb (cr, VGA_palette_registers[(index * 3) + 0] / 255.0, VGA_palette_registers[(index * 3) + 1] / 255.0, VGA_palette_registers[(index * 3) + 2] / 255.0);
+		cairo_rectangle (cr, index * barWidth, histogram_height - barHeight, barWidth, barHeight);
+		cairo_fill (cr);
+	}
+	return FALSE;
+}
+
+void
+histogram_closed (GtkWidget *widget,
+               gpointer  user_data)
+{
+	histogramWindow = NULL;
+}
+
+void
+histogram_menuitem_click (GtkMenuItem *menuitem) {
+	if(histogramWindow == NULL) {
+		histogramWindow = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+		gtk_window_set_title (GTK_WINDOW (histogramWindow), "Palette Usage");
+		gtk_container_set_border_width (GTK_CONTAINER (histogramWindow), 8);
+		g_signal_connect (histogramWindow, "destroy", G_CALLBACK (histogram_closed), NULL);
+
+		GtkWidget *grid = gtk_grid_new ();
+		gtk_container_add (GTK_CONTAINER (histogramWindow), grid);
+
+		histogramArea = gtk_drawing_area_new ();
+		gtk_widget_set_size_request (histogramArea, histogram_width, histogram_height);
+		g_signal_connect (histogramArea, "draw", G_CALLBACK (histogram_draw_cb), NULL);
+		gtk_grid_attach (GTK_GRID (grid), histogramArea, 0, 0, 1, 1);
+
+		histogramReport = gtk_label_new ("");
+		gtk_label_set_line_wrap (GTK_LABEL (histogramReport), TRUE);
+		gtk_label_set_max_width_chars (GTK_LABEL (histogramReport), 80);
+		gtk_label_set_xalign (GTK_LABEL (histogramReport), 0);
+		gtk_grid_attach (GTK_GRID (grid), histogramReport, 0, 1, 1, 1);
+
+		gtk_widget_show_all (histogramWindow);
+	}
+	update_histogram_report(NULL);
+	gtk_window_present (GTK_WINDOW (histogramWindow));
+}
+
+/*
+ Sets the VGA pixels x0 ... x1 of row y to one color.
+ The VGA row is filled with memset and the RGB row is filled by doubling the already filled part with memcpy.
+*/
+void fill_vga_span(int x0, int x1, int y, int vga_pixel) {
+	add_palette_usage(VGA_screen + ((size_t) y * imageWidth) + x0, x1 - x0 + 1, -1);
+	palette_usage[vga_pixel] += x1 - x0 + 1;
+	memset(VGA_screen + ((size_t) y * imageWidth) + x0, vga_pixel, x1 - x0 + 1);
+
+	// Only the part on the VGA screen is shown.
+	if(y >= 200 || x0 > 319) return;
+	if(x1 > 319) x1 = 319;
+	guchar *row = data + (y * pixel_size * drawingAreaRowStride) + (x0 * pixel_size * 3);
+	int rowBytes = (x1 - x0 + 1) * pixel_size * 3;
+	for(int squareX = 0; squareX < pixel_size; squareX++)
+	{
+		row[(squareX * 3) + 0] = VGA_palette_registers[(vga_pixel * 3) + 0];
+		row[(squareX * 3) + 1] = VGA_palette_registers[(vga_pixel * 3) + 1];
+		row[(squareX * 3) + 2] = VGA_palette_registers[(vga_pixel * 3) + 2];
+	}
+	int filled = pixel_size * 3;
+	while(filled < rowBytes)
+	{
+		int count = (rowBytes - filled < filled) ? rowBytes - filled : filled;
+		memcpy(row + filled, row, count);
+		filled += count;
+	}
+	for(int squareY = 1; squareY < pixel_size; squareY++)
+	{
+		memcpy(row + (squareY * drawingAreaRowStride), row, rowBytes);
+	}
+}
+
+// Precalculates the span of each row of the round brush, so that stamping it needs no per-pixel distance checks.
+void build_brush_spans() {
+	double center = (brush_size - 1) / 2.0;
+	double radiusSquared = (brush_size / 2.0) * (brush_size / 2.0);
+	for(int row = 0; row < brush_size; row++) {
+		double dy = row - center;
+		brush_span_start[row] = brush_size;
+		brush_span_end[row] = -1;
+		for(int col = 0; col < brush_size; col++) {
+			double dx = col - center;
+			if((dx * dx) + (dy * dy) <= radiusSquared) {
+				if(col < brush_span_start[row]) brush_span_start[row] = col;
+				brush_span_end[row] = col;
+			}
+		}
+	}
+}
+
+// Copies pixels to be used as the custom brush. srcStride is the distance between the rows of src.
+void capture_brush_stamp(const unsigned char *src, int srcStride, int width, int height) {
+	for(int row = 0; row < height; row++) {
+		memcpy(brush_stamp + (row * width), src + (row * srcStride), width);
+	}
+	brush_stamp_width = width;
+	brush_stamp_height = height;
+}
+
+/*
+ Stamps the current brush so that its center is at the VGA coordinate (vx, vy).
+ Every row of the brush is clipped to the image and written as one horizontal span.
+ The area that was drawn on is added to box (left, top, right, bottom in VGA coordinates).
+*/
+void stamp_brush(int vga_pixel, int vx, int vy, int *box) {
+	int width = brush_size;
+	int height = brush_size;
+	if(brush_shape == BRUSH_SHAPE_STAMP) {
+		width = brush_stamp_width;
+		height = brush_stamp_height;
+	}
+	int left = vx - ((width - 1) / 2);
+	int top = vy - ((height - 1) / 2);
+	unsigned char *pattern = brush_patterns[brush_pattern];
+
+	for(int row = 0; row < height; row++) {
+		int y = top + row;
+		if(y < 0 || y >= imageHeight) continue;
+		int x0 = left;
+		int x1 = left + width - 1;
+		if(brush_shape == BRUSH_SHAPE_ROUND) {
+			x0 = left + brush_span_start[row];
+			x1 = left + brush_span_end[row];
+		}
+		if(x0 < 0) x0 = 0;
+		if(x1 >= imageWidth) x1 = imageWidth - 1;
+		if(x0 > x1) continue;
+
+		unsigned char patternRow = pattern[y & 7];
+		unsigned char *dst = VGA_screen + ((size_t) y * imageWidth);
+		if(brush_shape == BRUSH_SHAPE_STAMP) {
+			unsigned char *src = brush_stamp + (row * width);
+			for(int x = x0; x <= x1; x++) {
+				if(src[x - left] != transparent_color && (patternRow & (0x80 >> (x & 7)))) {
+					palette_usage[dst[x]]--;
+					palette_usage[src[x - left]]++;
+					dst[x] = src[x - left];
+				}
+			}
+			put_vga_span_to_screen(x0, x1, y);
+		}
+		else if(patternRow == 0xFF) {
+			fill_vga_span(x0, x1, y, vga_pixel);
+		}
+		else if(patternRow != 0) {
+			for(int x = x0; x <= x1; x++) {
+				if(patternRow & (0x80 >> (x & 7))) {
+					palette_usage[dst[x]]--;
+					palette_usage[vga_pixel]++;
+					dst[x] = vga_pixel;
+				}
+			}
+			put_vga_span_to_screen(x0, x1, y);
+		}
+		else continue;
+
+		if(x0 < box[0]) box[0] = x0;
+		if(y < box[1]) box[1] = y;
+		if(x1 > box[2]) box[2] = x1;
+		if(y > box[3]) box[3] = y;
+	}
+}
+
+/*
+ Draws with the current brush at the mouse position (x, y).
+ While a stroke is in progress, the brush is stamped along the line from the previous position,
+ so that fast pointer movement leaves no gaps. The whole line is redrawn with a single queued draw.
+*/
+void draw_brush(int vga_pixel, int x, int y) {
+	int vx = x / pixel_size;
+	int vy = y / pixel_size;
+	if(brush_shape == BRUSH_SHAPE_STAMP && brush_stamp_width == 0) return;
+
+	int box[4] = { imageWidth, imageHeight, -1, -1 };
+	if(stroke_last_x < 0) {
+		stamp_brush(vga_pixel, vx, vy, box);
+	}
+	else {
+		// Larger brushes overlap enough that they don't have to be stamped on every pixel of the line.
+		int spacing = (brush_shape == BRUSH_SHAPE_STAMP) ? (std::max(brush_stamp_width, brush_stamp_height) / 4) + 1 : (brush_size / 4) + 1;
+		int dx = abs(vx - stroke_last_x);
+		int dy = abs(vy - stroke_last_y);
+		int steps = (dx > dy) ? dx : dy;
+		for(int step = spacing; step < steps; step += spacing) {
+			stamp_brush(vga_pixel, stroke_last_x + (((vx - stroke_last_x) * step) / steps), stroke_last_y + (((vy - stroke_last_y) * step) / steps), box);
+		}
+		stamp_brush(vga_pixel, vx, vy, box);
+	}
+	stroke_last_x = vx;
+	stroke_last_y = vy;
+
+	if(box[2] >= box[0]) {
+		gtk_widget_queue_draw_area (da, box[0] * pixel_size, box[1] * pixel_size, (box[2] - box[0] + 1) * pixel_size, (box[3] - box[1] + 1) * pixel_size);
+		palette_usage_changed();
+	}
+}
+
+/*
+ Moves or resizes the selection. Only the areas covered by the old and the new selection are redrawn.
+*/
+void set_selection_rect(int x, int y, int width, int height) {
+	int oldX = selection_x;
+	int oldY = selection_y;
+	int oldWidth = selection_width;
+	int oldHeight = selection_height;
+	bool wasActive = selection_active;
+
+	selection_x = x;
+	selection_y = y;
+	selection_width = width;
+	selection_height = height;
+	selection_active = true;
+
+	if(wasActive) {
+		put_vga_rect_to_screen(oldX, oldY, oldWidth, oldHeight);
+		queue_vga_rect(oldX, oldY, oldWidth, oldHeight);
+	}
+	put_vga_rect_to_screen(x, y, width, height);
+	queue_vga_rect(x, y, width, height);
+}
+
+// Lifts the selected pixels off the image so that they can be moved. The uncovered area gets the color of brush 2.
+void lift_selection() {
+	for(int row = 0; row < selection_height; row++) {
+		unsigned char *src = VGA_screen + ((size_t) (selection_y + row) * imageWidth) + selection_x;
+		memcpy(floating_pixels + (row * selection_width), src, selection_width);
+		add_palette_usage(src, selection_width, -1);
+		memset(src, brush2_color, selection_width);
+	}
+	palette_usage[brush2_color] += selection_width * selection_height;
+	selection_floating = true;
+	palette_usage_changed();
+}
+
+// Places the floating selection onto the image (skipping its transparent pixels) and removes the selection.
+void drop_selection() {
+	if(!selection_active) return;
+	if(selection_floating) {
+		int x0 = (selection_x < 0) ? 0 : selection_x;
+		int x1 = (selection_x + selection_width > imageWidth) ? imageWidth - 1 : selection_x + selection_width - 1;
+		for(int y = selection_y; y < selection_y + selection_height; y++) {
+			if(y < 0 || y >= imageHeight || x0 > x1) continue;
+			unsigned char *dst = VGA_screen + ((size_t) y * imageWidth) + x0;
+			add_palette_usage(dst, x1 - x0 + 1, -1);
+			blit_masked_row(dst, floating_pixels + ((y - selection_y) * selection_width) + (x0 - selection_x), x1 - x0 + 1, transparent_color);
+			add_palette_usage(dst, x1 - x0 + 1, 1);
+		}
+		selection_floating = false;
+		palette_usage_changed();
+	}
+	selection_active = false;
+	put_vga_rect_to_screen(selection_x, selection_y, selection_width, selection_height);
+	queue_vga_rect(selection_x, selection_y, selection_width, selection_height);
+}
+
+// Removes the selection without placing a floating selection onto the image, eg. when another image is loaded.
+void clear_selection() {
+	selection_active = false;
+	selection_floating = false;
+	selection_drag = SELECTION_DRAG_NONE;
+}
+
+// Copies the selected pixels to the clipboard, from the floating selection if there is one.
+void copy_selection() {
+	if(!selection_active) return;
+	for(int row = 0; row < selection_height; row++) {
+		const unsigned char *src = selection_floating ? floating_pixels + (row * selection_width) : VGA_screen + ((size_t) (selection_y + row) * imageWidth) + selection_x;
+		memcpy(clipboard_pixels + (row * selection_width), src, selection_width);
+	}
+	clipboard_width = selection_width;
+	clipboard_height = selection_height;
+}
+
+void selection_button_press(int vx, int vy) {
+	if(selection_active && vx >= selection_x && vx < selection_x + selection_width && vy >= selection_y && vy < selection_y + selection_height) {
+		if(!selection_floating) lift_selection();
+		selection_drag = SELECTION_DRAG_MOVE;
+		drag_anchor_x = vx - selection_x;
+		drag_anchor_y = vy - selection_y;
+		return;
+	}
+	drop_selection();
+	// Selections are limited to the part of the image that is shown, which also keeps them within the 64000-byte buffers.
+	if(vx >= std::min(imageWidth, 320) || vy >= std::min(imageHeight, 200)) return;
+	selection_drag = SELECTION_DRAG_CREATE;
+	drag_anchor_x = vx;
+	drag_anchor_y = vy;
+	set_selection_rect(vx, vy, 1, 1);
+}
+
+void selection_motion(int vx, int vy) {
+	if(selection_drag == SELECTION_DRAG_MOVE) {
+		if(vx - drag_anchor_x != selection_x || vy - drag_anchor_y != selection_y) {
+			set_selection_rect(vx - drag_anchor_x, vy - drag_anchor_y, selection_width, selection_height);
+		}
+	}
+	if(selection_drag == SELECTION_DRAG_CREATE) {
+		if(vx < 0) vx = 0;
+		if(vy < 0) vy = 0;
+		if(vx >= std::min(imageWidth, 320)) vx = std::min(imageWidth, 320) - 1;
+		if(vy >= std::min(imageHeight, 200)) vy = std::min(imageHeight, 200) - 1;
+		int x = (vx < drag_anchor_x) ? vx : drag_anchor_x;
+		int y = (vy < drag_anchor_y) ? vy : drag_anchor_y;
+		set_selection_rect(x, y, abs(vx - drag_anchor_x) + 1, abs(vy - drag_anchor_y) + 1);
+	}
 }
 
 static gboolean
@@ -257,24 +1014,28 @@ motion_notify_event_cb (GtkWidget      *widget,
 	if (surface == NULL)
 		return FALSE;
 
-	int brush_color;
+	// Moving the pointer without a button held doesn't change the image.
+	if(event->state & (GDK_BUTTON1_MASK | GDK_BUTTON3_MASK)) record_event("motion %g %g %u", event->x, event->y, event->state);
+
+	if(current_tool == TOOL_SELECT) {
+		if (event->state & GDK_BUTTON1_MASK) {
+			selection_motion (event->x / pixel_size, event->y / pixel_size);
+		}
+		return TRUE;
+	}
 
 	if(event->x < (320 * pixel_size) && event->y < (200 * pixel_size)) {
 		if (event->state & GDK_BUTTON1_MASK) {
-			brush_color = brush1_color;
-			int colorR = VGA_palette_registers[(brush_color * 3) + 0];
-			int colorG = VGA_palette_registers[(brush_color * 3) + 1];
-			int colorB = VGA_palette_registers[(brush_color * 3) + 2];
-			draw_brush (brush_color, colorR, colorG, colorB, event->x, event->y);
+			draw_brush (brush1_color, event->x, event->y);
 		}
 		if (event->state & GDK_BUTTON3_MASK) {
-			brush_color = brush2_color;
-			int colorR = VGA_palette_registers[(brush_color * 3) + 0];
-			int colorG = VGA_palette_registers[(brush_color * 3) + 1];
-			int colorB = VGA_palette_registers[(brush_color * 3) + 2];
-			draw_brush (brush_color, colorR, colorG, colorB, event->x, event->y);
+			draw_brush (brush2_color, event->x, event->y);
 		}
 	}
+	else {
+		// The stroke continues from where the pointer comes back, not from where it left.
+		stroke_last_x = -1;
+	}
 
 	return TRUE;
 }
@@ -288,6 +1049,12 @@ button_press_event_cb (GtkWidget      *widget,
 	if (surface == NULL)
 		return FALSE;
 
+	// Only the left and right buttons have a brush color.
+	if (event->button != GDK_BUTTON_PRIMARY && event->button != GDK_BUTTON_SECONDARY)
+		return FALSE;
+
+	record_event("press %g %g %u", event->x, event->y, event->button);
+
 	int brush_color;
 
 	bool left_click;
@@ -300,12 +1067,15 @@ button_press_event_cb (GtkWidget      *widget,
 		left_click = false;
 	}
 
-	int colorR = VGA_palette_registers[(brush_color * 3) + 0];
-	int colorG = VGA_palette_registers[(brush_color * 3) + 1];
-	int colorB = VGA_palette_registers[(brush_color * 3) + 2];
-
 	if(event->x < (320 * pixel_size) && event->y < (200 * pixel_size)) {
-		draw_brush (brush_color, colorR, colorG, colorB, event->x, event->y);
+		if(current_tool == TOOL_SELECT) {
+			if(left_click) selection_button_press(event->x / pixel_size, event->y / pixel_size);
+			else drop_selection();
+		}
+		else {
+			stroke_last_x = -1; // A new stroke starts.
+			draw_brush (brush_color, event->x, event->y);
+		}
 	}
 	else {
 		if(event->y >= (200 * pixel_size)) {
@@ -315,14 +1085,9 @@ button_press_event_cb (GtkWidget      *widget,
 				brush1_color = color_index;
 			}
 			else brush2_color = color_index;
-			colorR = VGA_palette_registers[(color_index * 3) + 0];
-			colorG = VGA_palette_registers[(color_index * 3) + 1];
-			colorB = VGA_palette_registers[(color_index * 3) + 2];
 			refresh_currently_selected_colors();
 			if(left_click) {
-				gtk_range_set_value(GTK_RANGE (slider), (colorR / 4));
-				gtk_range_set_value(GTK_RANGE (slider2), (colorG / 4));
-				gtk_range_set_value(GTK_RANGE (slider3), (colorB / 4));
+				set_sliders_to_color(color_index);
 			}
 		}
 	}
@@ -330,7 +1095,20 @@ button_press_event_cb (GtkWidget      *widget,
 	return TRUE;
 }
 
-int getFileType(char *filename) {
+static gboolean
+button_release_event_cb (GtkWidget      *widget,
+                         GdkEventButton *event,
+                         gpointer        data)
+{
+	if (event->button != GDK_BUTTON_PRIMARY && event->button != GDK_BUTTON_SECONDARY)
+		return FALSE;
+
+	record_event("release %g %g %u", event->x, event->y, event->button);
+	selection_drag = SELECTION_DRAG_NONE;
+	return TRUE;
+}
+
+int getFileType(const char *filename) {
 	int pos = 0;
 	while(filename[pos] != 0)
 	{
@@ -359,6 +1137,13 @@ int getFileType(char *filename) {
 				{
 					return FILE_EXTENSION_PIC;
 				}
+				// .IMG file extension?
+				if((filename[pos + 1] == 'i' || filename[pos + 1] == 'I') && 
+				(filename[pos + 2] == 'm' || filename[pos + 2] == 'M') && 
+				(filename[pos + 3] == 'g' || filename[pos + 3] == 'G'))
+				{
+					return FILE_EXTENSION_IMG;
+				}
 			}
 		}
 		pos++;
@@ -366,48 +1151,550 @@ int getFileType(char *filename) {
 	return 0;
 }
 
-void set_size_of_drawingarea(int newWidth, int newHeight) {
-	int widthOfDisabledArea = 320 - newWidth;
-	int heightOfDisabledArea = 200 - newHeight;
-	int x;
-	int y = 0;
-
-	put_vga_picture_to_screen();
+/*
+ Runs job(firstRow, endRow) for the rows 0 ... rows - 1.
+ Large images are split into bands of rows, one band per hardware thread.
+*/
+void run_rows_in_parallel(int rows, int rowLength, const std::function<void(int, int)> &job) {
+	int threads = std::thread::hardware_concurrency();
+	if(threads > rows) threads = rows;
+	if(threads < 2 || (long)rows * rowLength < parallel_transform_threshold) {
+		job(0, rows);
+		return;
+	}
+	std::vector<std::thread> workers;
+	for(int band = 0; band < threads; band++) {
+		workers.emplace_back(job, (rows * band) / threads, (rows * (band + 1)) / threads);
+	}
+	for(unsigned int worker = 0; worker < workers.size(); worker++) {
+		workers[worker].join();
+	}
+}
 
-	if(newWidth < 320) {
-		for(int currHeight = 200; currHeight > 0; currHeight--) {
-			x = newWidth * pixel_size;
-			for(int currWidth = widthOfDisabledArea; currWidth > 0; currWidth--) {
-				put_pixel(DISABLED_AREA_OF_DRAWINGAREA_COLOR_R, DISABLED_AREA_OF_DRAWINGAREA_COLOR_G, DISABLED_AREA_OF_DRAWINGAREA_COLOR_B, x, y);
-				x += pixel_size;
+/*
+ Transforms an indexed image without touching its palette. Pixels are only ever copied, never blended.
+ srcStride is the distance between the rows of src. For TRANSFORM_SCALE, dstWidth and dstHeight give the new size,
+ for the other transforms they are set to the size of the result. angle is in degrees, clockwise.
+ Rotating by an angle uses background for the corners that are outside of the source image.
+ All stepping through the source image is done in 16.16 fixed point, with nearest-neighbor sampling.
+*/
+void transform_image(int transform, const unsigned char *src, int srcStride, int width, int height, std::vector<unsigned char> &dst, int &dstWidth, int &dstHeight, double angle, int background) {
+	if(transform == TRANSFORM_ROTATE_ANGLE) {
+		int quarterTurns = (int)lround(angle / 90.0);
+		if(fabs(angle - (quarterTurns * 90.0)) < 0.001) {
+			// Exact multiples of 90 degrees are done without rounding errors.
+			quarterTurns = ((quarterTurns % 4) + 4) % 4;
+			if(quarterTurns == 1) transform = TRANSFORM_ROTATE_CLOCKWISE;
+			else if(quarterTurns == 3) transform = TRANSFORM_ROTATE_COUNTERCLOCKWISE;
+			else if(quarterTurns == 2) {
+				std::vector<unsigned char> flipped;
+				transform_image(TRANSFORM_FLIP_HORIZONTAL, src, srcStride, width, height, flipped, dstWidth, dstHeight, 0, background);
+				transform_image(TRANSFORM_FLIP_VERTICAL, flipped.data(), width, width, height, dst, dstWidth, dstHeight, 0, background);
+				return;
+			}
+			else {
+				transform = TRANSFORM_SCALE;
+				dstWidth = width;
+				dstHeight = height;
 			}
-			y += pixel_size;
 		}
 	}
 
-	if(newHeight < 200) {
-		y = newHeight * pixel_size;
-		for(int currHeight = heightOfDisabledArea; currHeight > 0; currHeight--) {
-			x = 0;
-			for(int currWidth = newWidth; currWidth > 0; currWidth--) {
-				put_pixel(DISABLED_AREA_OF_DRAWINGAREA_COLOR_R, DISABLED_AREA_OF_DRAWINGAREA_COLOR_G, DISABLED_AREA_OF_DRAWINGAREA_COLOR_B, x, y);
-				x += pixel_size;
+	if(transform == TRANSFORM_FLIP_HORIZONTAL || transform == TRANSFORM_FLIP_VERTICAL || (transform == TRANSFORM_SCALE && dstWidth == width && dstHeight == height)) {
+		dstWidth = width;
+		dstHeight = height;
+		dst.resize(width * height);
+		for(int y = 0; y < height; y++) {
+			const unsigned char *srcRow = src + (((transform == TRANSFORM_FLIP_VERTICAL) ? height - 1 - y : y) * srcStride);
+			unsigned char *dstRow = dst.data() + (y * width);
+			if(transform == TRANSFORM_FLIP_HORIZONTAL) {
+				for(int x = 0; x < width; x++) dstRow[x] = srcRow[width - 1 - x];
 			}
-			y += pixel_size;
+			else memcpy(dstRow, srcRow, width);
 		}
+		return;
 	}
-	imageWidth = newWidth;
-	imageHeight = newHeight;
-	loadedSize = imageWidth * imageHeight;
-	gtk_widget_queue_draw_area (da, 0, 0, 320 * pixel_size, 200 * pixel_size);
-}
-
-void
-menuitemclick (GtkMenuItem *menuitem) {
 
-	GtkWidget *dialog;
-	GtkFileChooserAction action = GTK_FILE_CHOOSER_ACTION_OPEN;
-	gint res;
+	if(transform == TRANSFORM_ROTATE_CLOCKWISE || transform == TRANSFORM_ROTATE_COUNTERCLOCKWISE) {
+		dstWidth = height;
+		dstHeight = width;
+		dst.resize(width * height);
+		unsigned char *out = dst.data();
+		bool clockwise = (transform == TRANSFORM_ROTATE_CLOCKWISE);
+		// Each destination row is one source column, read from the bottom up (clockwise) or from the top down.
+		run_rows_in_parallel(dstHeight, dstWidth, [=](int firstRow, int endRow) {
+			for(int y = firstRow; y < endRow; y++) {
+				int column = clockwise ? y : width - 1 - y;
+				const unsigned char *in = clockwise ? src + ((height - 1) * srcStride) + column : src + column;
+				int step = clockwise ? -srcStride : srcStride;
+				unsigned char *dstRow = out + (y * dstWidth);
+				for(int x = 0; x < dstWidth; x++) {
+					dstRow[x] = *in;
+					in += step;
+				}
+			}
+		});
+		return;
+	}
+
+	if(transform == TRANSFORM_SCALE) {
+		if(dstWidth < 1 || dstHeight < 1) return;
+		dst.resize(dstWidth * dstHeight);
+		unsigned char *out = dst.data();
+		int outWidth = dstWidth;
+		int64_t stepX = ((int64_t)width << 16) / dstWidth;
+		int64_t stepY = ((int64_t)height << 16) / dstHeight;
+		run_rows_in_parallel(dstHeight, dstWidth, [=](int firstRow, int endRow) {
+			for(int y = firstRow; y < endRow; y++) {
+				const unsigned char *srcRow = src + (((stepY / 2) + (y * stepY)) >> 16) * srcStride;
+				unsigned char *dstRow = out + (y * outWidth);
+				int64_t u = stepX / 2;
+				for(int x = 0; x < outWidth; x++) {
+					dstRow[x] = srcRow[u >> 16];
+					u += stepX;
+				}
+			}
+		});
+		return;
+	}
+
+	if(transform == TRANSFORM_ROTATE_ANGLE) {
+		double radians = angle * M_PI / 180.0;
+		double cosine = cos(radians);
+		double sine = sin(radians);
+		dstWidth = (int)ceil((fabs(width * cosine) + fabs(height * sine)) - 0.001);
+		dstHeight = (int)ceil((fabs(width * sine) + fabs(height * cosine)) - 0.001);
+		dst.resize(dstWidth * dstHeight);
+		unsigned char *out = dst.data();
+		int outWidth = dstWidth;
+		int outHeight = dstHeight;
+		int64_t cosineStep = llround(cosine * 65536.0);
+		int64_t sineStep = llround(sine * 65536.0);
+		// The source position of each destination pixel is found by rotating backwards around the centers of the images.
+		run_rows_in_parallel(dstHeight, dstWidth, [=](int firstRow, int endRow) {
+			for(int y = firstRow; y < endRow; y++) {
+				double dx = 0.5 - (outWidth / 2.0);
+				double dy = (y + 0.5) - (outHeight / 2.0);
+				int64_t u = llround(((cosine * dx) + (sine * dy) + (width / 2.0)) * 65536.0);
+				int64_t v = llround(((cosine * dy) - (sine * dx) + (height / 2.0)) * 65536.0);
+				unsigned char *dstRow = out + (y * outWidth);
+				for(int x = 0; x < outWidth; x++) {
+					int sx = (int)(u >> 16);
+					int sy = (int)(v >> 16);
+					if(u >= 0 && v >= 0 && sx < width && sy < height) dstRow[x] = src[(sy * srcStride) + sx];
+					else dstRow[x] = background;
+					u += cosineStep;
+					v -= sineStep;
+				}
+			}
+		});
+	}
+}
+
+/*
+ Computes the size of the result of transform_image without transforming anything, so that too large results can be refused
+ before they are allocated. For TRANSFORM_SCALE, newWidth and newHeight must already hold the new size.
+*/
+void transformed_size(int transform, int width, int height, double angle, int &newWidth, int &newHeight) {
+	if(transform == TRANSFORM_ROTATE_ANGLE) {
+		int quarterTurns = (int)lround(angle / 90.0);
+		if(fabs(angle - (quarterTurns * 90.0)) < 0.001) {
+			transform = (quarterTurns % 2 != 0) ? TRANSFORM_ROTATE_CLOCKWISE : TRANSFORM_FLIP_HORIZONTAL;
+		}
+		else {
+			double radians = angle * M_PI / 180.0;
+			newWidth = (int)ceil((fabs(width * cos(radians)) + fabs(height * sin(radians))) - 0.001);
+			newHeight = (int)ceil((fabs(width * sin(radians)) + fabs(height * cos(radians))) - 0.001);
+			return;
+		}
+	}
+	if(transform == TRANSFORM_ROTATE_CLOCKWISE || transform == TRANSFORM_ROTATE_COUNTERCLOCKWISE) {
+		newWidth = height;
+		newHeight = width;
+	}
+	else if(transform != TRANSFORM_SCALE) {
+		newWidth = width;
+		newHeight = height;
+	}
+}
+
+// Reads the angle for TRANSFORM_ROTATE_ANGLE (degrees) from text. Returns false if the text isn't a number.
+bool parse_angle(std::string text, double &angle) {
+	char *end;
+	angle = strtod(text.c_str(), &end);
+	return *end == 0 && text.length() > 0 && std::isfinite(angle);
+}
+
+/*
+ Reads the new size for TRANSFORM_SCALE from text, which is either a factor ("2", "0.5") or a size ("160x100").
+ Returns false if the text is neither.
+*/
+bool parse_scale(std::string text, int width, int height, int &newWidth, int &newHeight) {
+	size_t separator = text.find_first_of("xX");
+	char *end;
+	// The sizes are checked before they are converted to int, as out of range values would wrap around.
+	double scaledWidth, scaledHeight;
+	if(separator != std::string::npos) {
+		scaledWidth = strtod(text.c_str(), &end);
+		if(end != text.c_str() + separator) return false;
+		scaledHeight = strtod(text.c_str() + separator + 1, &end);
+		if(scaledWidth != floor(scaledWidth) || scaledHeight != floor(scaledHeight)) return false;
+	}
+	else {
+		double factor = strtod(text.c_str(), &end);
+		if(!std::isfinite(factor)) return false;
+		scaledWidth = round(width * factor);
+		scaledHeight = round(height * factor);
+	}
+	if(*end != 0 || text.length() == 0 || !(scaledWidth >= 1 && scaledHeight >= 1 && scaledWidth <= 65535 && scaledHeight <= 65535)) return false;
+	newWidth = (int) scaledWidth;
+	newHeight = (int) scaledHeight;
+	return true;
+}
+
+/*
+ Reads a .VGA, .IMG or .PIC image file. If the file has a palette (.IMG), it is copied to palette as 6-bit VGA values
+ and hasPalette is set. Returns false if the file can't be read or isn't an image file.
+*/
+bool read_image_file(const char *filename, PooledBuffer &pixels, int &width, int &height, unsigned char *palette, bool &hasPalette) {
+	int fileType = getFileType(filename);
+	hasPalette = false;
+	if(fileType != FILE_EXTENSION_VGA && fileType != FILE_EXTENSION_IMG && fileType != FILE_EXTENSION_PIC) return false;
+
+	std::ifstream sourcefile(filename, std::ios::in|std::ios::binary|std::ios::ate);
+	if(!sourcefile) return false;
+	long fileSize = sourcefile.tellg();
+	sourcefile.seekg (0, std::ios::beg);
+
+	width = 320;
+	height = 200;
+	if(fileType == FILE_EXTENSION_PIC) {
+		unsigned char header[4];
+		if(!sourcefile.read ((char*) header, 4)) return false;
+		width = (header[1] * 256) + header[0];
+		height = (header[3] * 256) + header[2];
+		fileSize -= 4;
+	}
+	if(width == 0 || height == 0 || fileSize < (long)width * height) return false;
+
+	if((long long) width * height > max_image_pixels || !pixels.resize((size_t) width * height)) return false;
+	sourcefile.read ((char*) pixels.data(), (size_t) width * height);
+	if(fileType == FILE_EXTENSION_IMG && fileSize >= 64768) {
+		sourcefile.read ((char*) palette, 768);
+		hasPalette = true;
+	}
+	return true;
+}
+
+/*
+ Writes an image to a .VGA, .IMG or .PIC file. .VGA and .IMG files must be 320x200.
+ palette (6-bit VGA values) is only used for .IMG files. Returns false if the file can't be written.
+*/
+bool write_image_file(const char *filename, const unsigned char *pixels, int width, int height, const unsigned char *palette) {
+	int fileType = getFileType(filename);
+	if(fileType != FILE_EXTENSION_PIC && ((fileType != FILE_EXTENSION_VGA && fileType != FILE_EXTENSION_IMG) || width != 320 || height != 200)) return false;
+
+	std::ofstream savedfile (filename, std::ios::out|std::ios::binary|std::ios::trunc);
+	if (!savedfile.is_open()) return false;
+	if(fileType == FILE_EXTENSION_PIC) {
+		unsigned char header[4] = { (unsigned char)(width % 256), (unsigned char)(width / 256), (unsigned char)(height % 256), (unsigned char)(height / 256) };
+		savedfile.write((const char*) header, 4);
+	}
+	savedfile.write((const char*) pixels, width * height);
+	if(fileType == FILE_EXTENSION_IMG) savedfile.write((const char*) palette, 768);
+	savedfile.close();
+	return !savedfile.fail();
+}
+
+/*
+ Changes the size of the image of the current document. The pixels that fit in both sizes are kept,
+ the new pixels get the color of brush 2.
+*/
+void set_size_of_drawingarea(int newWidth, int newHeight) {
+	drop_selection();
+	if(newWidth != document->width || newHeight != document->height) {
+		if(!document->resize(newWidth, newHeight, brush2_color)) std::cout << "Not enough memory for a " << newWidth << "x" << newHeight << " image." << std::endl;
+		bind_document(document);
+	}
+	count_palette_usage();
+	palette_usage_changed();
+	put_vga_picture_to_screen();
+}
+
+// Updates everything that shows the colors of the palette.
+void refresh_palette_display() {
+	put_vga_picture_to_screen();
+	create_palette_toolbar();
+	palette_usage_changed();
+	set_sliders_to_color(brush1_color);
+}
+
+// Sets the palette from 6-bit VGA values and updates everything that shows palette colors.
+void apply_vga_palette(const unsigned char *palette) {
+	for(int pos = 0; pos < 768; pos++)
+	{
+		VGA_palette_registers[pos] = palette[pos] * 4;
+	}
+	// After loading the palette, we must update the colors of the image so that they correspond to the current VGA palette values.
+	refresh_palette_display();
+}
+
+// Replaces the image of the current document with the given pixels. Only the top left 320x200 pixels are shown.
+void put_image_to_canvas(const unsigned char *pixels, int width, int height) {
+	clear_selection();
+	if(!document->replace(pixels, width, height)) {
+		std::cout << "Not enough memory for a " << width << "x" << height << " image." << std::endl;
+		return;
+	}
+	bind_document(document);
+	count_palette_usage();
+	palette_usage_changed();
+	put_vga_picture_to_screen();
+}
+
+/*
+ Live reload
+
+ The directories of the image and palette files of every open document are watched with inotify. Scripts that regenerate the files
+ usually write them in several steps, so the reload waits until there have been no changes for live_reload_delay ms.
+ A changed palette only re-colors the image. A changed image of the same size only updates the rows that differ.
+ Changes to the files of a document that isn't shown are remembered and reloaded when the document is shown again.
+*/
+int inotify_fd = -1;
+std::vector<int> file_watches; // Watch descriptors of all watched directories
+guint reload_timer = 0;
+
+std::string file_name_part(const std::string &path) {
+	size_t slash = path.find_last_of('/');
+	return (slash == std::string::npos) ? path : path.substr(slash + 1);
+}
+
+std::string directory_part(const std::string &path) {
+	size_t slash = path.find_last_of('/');
+	return (slash == std::string::npos) ? "." : path.substr(0, slash + 1);
+}
+
+void reload_palette() {
+	unsigned char palette[768];
+	std::ifstream palettefile(document->palettePath, std::ios::in|std::ios::binary);
+	if(!palettefile || !palettefile.read((char*) palette, 768)) return;
+	std::cout << "Reloaded VGA palette file " << document->palettePath << std::endl;
+	apply_vga_palette(palette);
+}
+
+void reload_image() {
+	PooledBuffer pixels;
+	int width, height;
+	unsigned char palette[768];
+	bool hasPalette;
+	if(!read_image_file(document->imagePath.c_str(), pixels, width, height, palette, hasPalette)) return;
+
+	if(width != imageWidth || height != imageHeight) {
+		std::cout << "Reloaded " << document->imagePath << " with the new size: " << width << "x" << height << std::endl;
+		put_image_to_canvas(pixels.data(), width, height);
+	}
+	else {
+		int changedRows = 0;
+		for(int y = 0; y < height; y++) {
+			unsigned char *row = VGA_screen + ((size_t) y * imageWidth);
+			if(memcmp(row, pixels.data() + ((size_t) y * width), width) != 0) {
+				add_palette_usage(row, width, -1);
+				memcpy(row, pixels.data() + ((size_t) y * width), width);
+				add_palette_usage(row, width, 1);
+				put_vga_rect_to_screen(0, y, 320, 1);
+				queue_vga_rect(0, y, 320, 1);
+				changedRows++;
+			}
+		}
+		std::cout << "Reloaded " << document->imagePath << ", " << changedRows << " rows changed" << std::endl;
+		if(changedRows > 0) palette_usage_changed();
+	}
+
+	if(hasPalette) {
+		bool paletteChanged = false;
+		for(int pos = 0; pos < 768; pos++) {
+			if(VGA_palette_registers[pos] != palette[pos] * 4) paletteChanged = true;
+		}
+		if(paletteChanged) apply_vga_palette(palette);
+	}
+}
+
+// Reloads the changed files of the current document.
+void reload_pending_files() {
+	if(document->imageReloadPending) reload_image();
+	if(document->paletteReloadPending) reload_palette();
+	document->imageReloadPending = false;
+	document->paletteReloadPending = false;
+}
+
+gboolean reload_timer_expired(gpointer user_data) {
+	reload_timer = 0;
+	reload_pending_files();
+	return FALSE;
+}
+
+gboolean inotify_readable(GIOChannel *channel, GIOCondition condition, gpointer user_data) {
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t length;
+	while((length = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+		for(char *pos = buffer; pos < buffer + length; pos += sizeof(struct inotify_event) + ((struct inotify_event*) pos)->len) {
+			struct inotify_event *event = (struct inotify_event*) pos;
+			if(event->len == 0) continue;
+			for(unsigned int doc = 0; doc < documents.size(); doc++) {
+				Document *changed = documents[doc].get();
+				if(event->wd == changed->imageWatch && file_name_part(changed->imagePath) == event->name) changed->imageReloadPending = true;
+				if(event->wd == changed->paletteWatch && file_name_part(changed->palettePath) == event->name) changed->paletteReloadPending = true;
+			}
+		}
+	}
+	if(document->imageReloadPending || document->paletteReloadPending) {
+		// Every new change restarts the wait.
+		if(reload_timer != 0) g_source_remove(reload_timer);
+		reload_timer = g_timeout_add(live_reload_delay, reload_timer_expired, NULL);
+	}
+	return TRUE;
+}
+
+/*
+ Watches the directories of the files of all open documents. Renames into the directory are caught too, as scripts often write
+ a temporary file first. Call this whenever a document is opened or closed or its files change.
+*/
+void update_file_watches() {
+	if(inotify_fd < 0) {
+		inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if(inotify_fd < 0) {
+			std::cout << "Live reload is not available: inotify_init1 failed." << std::endl;
+			return;
+		}
+		GIOChannel *channel = g_io_channel_unix_new(inotify_fd);
+		g_io_add_watch(channel, G_IO_IN, inotify_readable, NULL);
+		g_io_channel_unref(channel);
+	}
+	// Watching the same directory twice gives the same watch descriptor.
+	std::vector<int> watches;
+	for(unsigned int doc = 0; doc < documents.size(); doc++) {
+		Document *watched = documents[doc].get();
+		watched->imageWatch = -1;
+		watched->paletteWatch = -1;
+		if(watched->imagePath.length() > 0) watched->imageWatch = inotify_add_watch(inotify_fd, directory_part(watched->imagePath).c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if(watched->palettePath.length() > 0) watched->paletteWatch = inotify_add_watch(inotify_fd, directory_part(watched->palettePath).c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if(watched->imageWatch >= 0) watches.push_back(watched->imageWatch);
+		if(watched->paletteWatch >= 0) watches.push_back(watched->paletteWatch);
+	}
+	// Directories that no document needs any more are no longer watched.
+	for(unsigned int watch = 0; watch < file_watches.size(); watch++) {
+		if(std::find(watches.begin(), watches.end(), file_watches[watch]) == watches.end()) inotify_rm_watch(inotify_fd, file_watches[watch]);
+	}
+	std::sort(watches.begin(), watches.end());
+	watches.erase(std::unique(watches.begin(), watches.end()), watches.end());
+	file_watches.swap(watches);
+}
+
+// Creates a new empty document with the given size and adds it to the document selector. It doesn't become the current document.
+Document *new_document(int width, int height, const std::string &name) {
+	documents.push_back(std::unique_ptr<Document>(new Document(width, height, name)));
+	if(documentSelector != NULL) {
+		switching_document = true;
+		gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT (documentSelector), name.c_str());
+		switching_document = false;
+	}
+	return documents.back().get();
+}
+
+// Makes the document with the given index the current document and shows it.
+void switch_document(int index) {
+	if(index < 0 || index >= (int) documents.size()) return;
+	drop_selection();
+	stroke_last_x = -1;
+	bind_document(documents[index].get());
+	count_palette_usage();
+	// Files that changed while the document wasn't shown are reloaded now.
+	reload_pending_files();
+	palette_usage_changed();
+	refresh_palette_display();
+	update_file_watches();
+	if(documentSelector != NULL && gtk_combo_box_get_active(GTK_COMBO_BOX (documentSelector)) != index) {
+		switching_document = true;
+		gtk_combo_box_set_active(GTK_COMBO_BOX (documentSelector), index);
+		switching_document = false;
+	}
+}
+
+// Closes the current document. Its pixels go back to the buffer pool. The last document is never closed.
+void close_document() {
+	if(documents.size() < 2) return;
+	int index = 0;
+	while(documents[index].get() != document) index++;
+	drop_selection();
+	documents.erase(documents.begin() + index);
+	if(documentSelector != NULL) {
+		switching_document = true;
+		gtk_combo_box_text_remove(GTK_COMBO_BOX_TEXT (documentSelector), index);
+		switching_document = false;
+	}
+	switch_document((index < (int) documents.size()) ? index : index - 1);
+}
+
+/*
+ Loads a palette file into the current document, or an image file into a new document.
+ A new document starts with the palette of the current document, unless the file has its own palette (.IMG).
+*/
+void open_file(const char *filename) {
+	int fileType = getFileType(filename);
+	record_event("open %s", filename);
+
+	if(fileType == FILE_EXTENSION_PAL) {
+		unsigned char palette[768];
+		std::ifstream sourcefile(filename, std::ios::in|std::ios::binary);
+		if(!sourcefile || !sourcefile.read ((char*) palette, 768))
+		{
+			std::cout << "Source file not found!" << std::endl;
+			return;
+		}
+		sourcefile.close();
+		std::cout << "Loaded VGA palette file." << std::endl;
+		apply_vga_palette(palette);
+		document->palettePath = filename;
+		update_file_watches();
+		return;
+	}
+
+	PooledBuffer pixels;
+	int width, height;
+	unsigned char palette[768];
+	bool hasPalette;
+	if(!read_image_file(filename, pixels, width, height, palette, hasPalette)) {
+		std::cout << "Source file not found!" << std::endl;
+		return;
+	}
+	if(fileType == FILE_EXTENSION_PIC) {
+		std::cout << "Loaded 256-color VGA image with the size: " << width << "x" << height << std::endl;
+	}
+	else std::cout << "Loaded 256-color VGA picture file." << std::endl;
+
+	const uint8_t *currentPalette = VGA_palette_registers;
+	std::string palettePath = document->palettePath;
+	Document *doc = new_document(0, 0, file_name_part(filename));
+	if(hasPalette) {
+		for(int pos = 0; pos < 768; pos++) doc->palette[pos] = palette[pos] * 4;
+	}
+	else {
+		memcpy(doc->palette, currentPalette, 768);
+		doc->palettePath = palettePath;
+	}
+	doc->pixels.swap(pixels);
+	doc->width = width;
+	doc->height = height;
+	doc->imagePath = filename;
+	switch_document(documents.size() - 1);
+}
+
+void
+menuitemclick (GtkMenuItem *menuitem) {
+
+	GtkWidget *dialog;
+	GtkFileChooserAction action = GTK_FILE_CHOOSER_ACTION_OPEN;
+	gint res;
 
 	dialog = gtk_file_chooser_dialog_new ("Open File",
 		NULL,
@@ -424,168 +1711,1123 @@ menuitemclick (GtkMenuItem *menuitem) {
 		char *filename;
 		GtkFileChooser *chooser = GTK_FILE_CHOOSER (dialog);
 		filename = gtk_file_chooser_get_filename (chooser);
+		open_file(filename);
+		g_free (filename);
+	}
+	gtk_widget_destroy (dialog);
+}
+
+void
+menuitem2click (GtkMenuItem *menuitem) {
+	GtkWidget *dialog;
+	GtkFileChooserAction action = GTK_FILE_CHOOSER_ACTION_SAVE;
+	gint res;
+
+	dialog = gtk_file_chooser_dialog_new ("Save File",
+		NULL,
+		action,
+		("_Cancel"),
+		GTK_RESPONSE_CANCEL,
+		("_Save"),
+		GTK_RESPONSE_ACCEPT,
+		NULL);
+
+	res = gtk_dialog_run (GTK_DIALOG (dialog));
+	if (res == GTK_RESPONSE_ACCEPT)
+	{
+		char *filename;
+		GtkFileChooser *chooser = GTK_FILE_CHOOSER (dialog);
+		filename = gtk_file_chooser_get_filename (chooser);
+
+		int fileType = getFileType(filename);
+		unsigned char palette[768];
+		for(int pos = 0; pos < 768; pos++)
+		{
+			palette[pos] = VGA_palette_registers[pos] / 4;
+		}
+		// .PAL file extension?
+		if(fileType == FILE_EXTENSION_PAL) {
+			std::cout << "saving pal file" << std::endl;
+			std::ofstream savedfile (filename, std::ios::out|std::ios::binary|std::ios::trunc);
+			if (savedfile.is_open())
+			{
+				savedfile.write((const char*) palette, 768);
+				savedfile.close();
+			}
+			else
+			{
+				std::cout << "Error creating file!" << std::endl;
+			}
+		}
+		// .VGA, .IMG or .PIC file extension?
+		if(fileType == FILE_EXTENSION_VGA || fileType == FILE_EXTENSION_IMG || fileType == FILE_EXTENSION_PIC) {
+			std::cout << "saving image file" << std::endl;
+			drop_selection();
+			if(!write_image_file(filename, VGA_screen, imageWidth, imageHeight, palette))
+			{
+				std::cout << "Error creating file! (.VGA and .IMG files must be 320x200)" << std::endl;
+			}
+		}
+		g_free (filename);
+	}
+	gtk_widget_destroy (dialog);
+}
+
+void
+new_menuitem_click (GtkMenuItem *menuitem) {
+	record_event("command new");
+	new_document(imageWidth, imageHeight, "Untitled");
+	switch_document(documents.size() - 1);
+}
+
+void
+close_menuitem_click (GtkMenuItem *menuitem) {
+	record_event("command close");
+	close_document();
+}
+
+void
+documentSelector_changed (GtkComboBox *combo,
+               gpointer  user_data)
+{
+	if(switching_document) return;
+	int index = gtk_combo_box_get_active(combo);
+	record_event("document %d", index);
+	switch_document(index);
+}
+
+/*
+ Call this with one of three values to change the value of R, G or B.
+ 0 = change R
+ 1 = change G
+ 2 = change B
+*/
+void change_palette_of_selected_color(int indexOfRorGorB, int pos)
+{
+	VGA_palette_registers[(brush1_color * 3) + indexOfRorGorB] = pos;
+	int pal_row = brush1_color / palette_square_cols;
+	int pal_square_index = pal_row * palette_square_cols;
+	int pal_square_x = (brush1_color - pal_square_index) * size_of_palette_square;
+	int pal_square_y = (drawingAreaHeight + (pal_row * size_of_palette_square));
+	put_palette_square_to_screen(pal_square_x, pal_square_y, brush1_color);
+	gtk_widget_queue_draw_area (da, pal_square_x, pal_square_y, size_of_palette_square, size_of_palette_square);
+	put_vga_picture_to_screen();
+	refresh_currently_selected_colors();
+	palette_usage_changed(); // The bars of the histogram have the palette colors
+}
+
+void
+slider_R_changed (GtkRange *range,
+               gpointer  user_data)
+{
+	int pos;
+	pos = gtk_range_get_value (GTK_RANGE (slider));
+	if(!setting_sliders) record_event("slider 0 %d", pos);
+	pos *= 4;
+	change_palette_of_selected_color(0, pos);
+}
+void
+slider_G_changed (GtkRange *range,
+               gpointer  user_data)
+{
+	int pos;
+	pos = gtk_range_get_value (GTK_RANGE (slider2));
+	if(!setting_sliders) record_event("slider 1 %d", pos);
+	pos *= 4;
+	change_palette_of_selected_color(1, pos);
+}
+void
+slider_B_changed (GtkRange *range,
+               gpointer  user_data)
+{
+	int pos;
+	pos = gtk_range_get_value (GTK_RANGE (slider3));
+	if(!setting_sliders) record_event("slider 2 %d", pos);
+	pos *= 4;
+	change_palette_of_selected_color(2, pos);
+}
+
+bool isNumeric(std::string givenText) {
+	bool isValid = true;
+	for(unsigned int pos = 0; pos < givenText.length(); pos++) {
+		if(givenText[pos] < '0' || givenText[pos] > '9') {
+			pos = givenText.length();
+			isValid = false;
+		}
+	}
+	return isValid;
+}
+
+void
+widthField_changed (GtkEntry *entry,
+               gpointer  user_data)
+{
+	std::string val = gtk_entry_get_text(GTK_ENTRY (widthField));
+	record_event("entry width %s", val.c_str());
+	if(!isNumeric(val) || val.length() == 0 || val.length() > 5 || stoi(val) < 1 || stoi(val) > 65535) {
+		std::cout << "The width must be 1 ... 65535." << std::endl;
+		return;
+	}
+	if((long long) stoi(val) * imageHeight > max_image_pixels) {
+		std::cout << "The image can have at most " << max_image_pixels << " pixels." << std::endl;
+		return;
+	}
+	set_size_of_drawingarea(stoi(val), imageHeight);
+}
+
+void
+heightField_changed (GtkEntry *entry,
+               gpointer  user_data)
+{
+	std::string val = gtk_entry_get_text(GTK_ENTRY (heightField));
+	record_event("entry height %s", val.c_str());
+	if(!isNumeric(val) || val.length() == 0 || val.length() > 5 || stoi(val) < 1 || stoi(val) > 65535) {
+		std::cout << "The height must be 1 ... 65535." << std::endl;
+		return;
+	}
+	if((long long) imageWidth * stoi(val) > max_image_pixels) {
+		std::cout << "The image can have at most " << max_image_pixels << " pixels." << std::endl;
+		return;
+	}
+	set_size_of_drawingarea(imageWidth, stoi(val));
+}
+
+void
+sourceColorField_changed (GtkEntry *entry,
+               gpointer  user_data)
+{
+	std::cout << "changed source color" << std::endl;
+}
+
+void
+targetColorField_changed (GtkEntry *entry,
+               gpointer  user_data)
+{
+	std::string sourceColorText = gtk_entry_get_text(GTK_ENTRY (sourceColorField));
+	std::string targetColorText = gtk_entry_get_text(GTK_ENTRY (targetColorField));
+	record_event("entry source %s", sourceColorText.c_str());
+	record_event("entry target %s", targetColorText.c_str());
+	bool validSourceColor = isNumeric(sourceColorText);
+	bool validTargetColor = isNumeric(targetColorText);
+	// Color indices have at most 3 digits, so stoi can't be given a number that is out of its range.
+	if(validSourceColor && validTargetColor && sourceColorText.length() > 0 && targetColorText.length() > 0 && sourceColorText.length() <= 3 && targetColorText.length() <= 3) {
+		int sourceColor = stoi(sourceColorText);
+		int targetColor = stoi(targetColorText);
+		if(sourceColor > 255 || targetColor > 255 || sourceColor == targetColor) return;
+		// The usage count tells when there is nothing to change, and when the last pixel to change has been found.
+		unsigned int remaining = palette_usage[sourceColor];
+		if(remaining == 0) {
+			std::cout << "No pixels use color " << sourceColor << std::endl;
+			return;
+		}
+		for(int y = 0; y < imageHeight && remaining > 0; y++) {
+			unsigned char *row = VGA_screen + ((size_t) y * imageWidth);
+			for(int x = 0; x < imageWidth; x++) {
+				if(row[x] == sourceColor) {
+					row[x] = targetColor;
+					if(--remaining == 0) break;
+				}
+			}
+		}
+		palette_usage[targetColor] += palette_usage[sourceColor];
+		palette_usage[sourceColor] = 0;
+		palette_usage_changed();
+		put_vga_picture_to_screen();
+	}
+}
+
+void
+brushSizeField_changed (GtkEntry *entry,
+               gpointer  user_data)
+{
+	std::string val = gtk_entry_get_text(GTK_ENTRY (brushSizeField));
+	record_event("entry brushsize %s", val.c_str());
+	if(isNumeric(val) && val.length() > 0 && val.length() <= 5) {
+		int newSize = stoi(val);
+		if(newSize < 1) newSize = 1;
+		if(newSize > max_brush_size) newSize = max_brush_size;
+		brush_size = newSize;
+		build_brush_spans();
+	}
+}
+
+void
+transparentColorField_changed (GtkEntry *entry,
+               gpointer  user_data)
+{
+	std::string val = gtk_entry_get_text(GTK_ENTRY (transparentColorField));
+	record_event("entry transparent %s", val.c_str());
+	if(isNumeric(val) && val.length() > 0 && val.length() <= 3) {
+		int color = stoi(val);
+		if(color < 256) transparent_color = color;
+	}
+}
+
+// user_data holds the BRUSH_SHAPE_ value of the menu item.
+void
+brush_shape_toggled (GtkCheckMenuItem *menuitem,
+               gpointer  user_data)
+{
+	if(gtk_check_menu_item_get_active(menuitem)) {
+		record_event("shape %d", GPOINTER_TO_INT(user_data));
+		brush_shape = GPOINTER_TO_INT(user_data);
+	}
+}
+
+// user_data holds the index of the pattern in brush_patterns.
+void
+brush_pattern_toggled (GtkCheckMenuItem *menuitem,
+               gpointer  user_data)
+{
+	if(gtk_check_menu_item_get_active(menuitem)) {
+		record_event("pattern %d", GPOINTER_TO_INT(user_data));
+		brush_pattern = GPOINTER_TO_INT(user_data);
+	}
+}
+
+// user_data holds the TOOL_ value of the menu item.
+void
+tool_toggled (GtkCheckMenuItem *menuitem,
+               gpointer  user_data)
+{
+	if(gtk_check_menu_item_get_active(menuitem)) {
+		record_event("tool %d", GPOINTER_TO_INT(user_data));
+		current_tool = GPOINTER_TO_INT(user_data);
+		if(current_tool != TOOL_SELECT) drop_selection();
+	}
+}
+
+void
+cut_menuitem_click (GtkMenuItem *menuitem) {
+	record_event("command cut");
+	if(!selection_active) return;
+	copy_selection();
+	if(!selection_floating) {
+		for(int row = 0; row < selection_height; row++) {
+			add_palette_usage(VGA_screen + ((size_t) (selection_y + row) * imageWidth) + selection_x, selection_width, -1);
+			memset(VGA_screen + ((size_t) (selection_y + row) * imageWidth) + selection_x, brush2_color, selection_width);
+		}
+		palette_usage[brush2_color] += selection_width * selection_height;
+		palette_usage_changed();
+	}
+	clear_selection();
+	put_vga_rect_to_screen(selection_x, selection_y, selection_width, selection_height);
+	queue_vga_rect(selection_x, selection_y, selection_width, selection_height);
+}
+
+void
+copy_menuitem_click (GtkMenuItem *menuitem) {
+	record_event("command copy");
+	copy_selection();
+}
+
+// The pasted pixels float at the top left corner of the image until they are moved and dropped with the selection tool.
+void
+paste_menuitem_click (GtkMenuItem *menuitem) {
+	record_event("command paste");
+	if(clipboard_width == 0) return;
+	drop_selection();
+	memcpy(floating_pixels, clipboard_pixels, clipboard_width * clipboard_height);
+	selection_floating = true;
+	gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM (selectToolMenuItem), TRUE);
+	set_selection_rect(0, 0, clipboard_width, clipboard_height);
+}
+
+void
+deselect_menuitem_click (GtkMenuItem *menuitem) {
+	record_event("command deselect");
+	drop_selection();
+}
+
+void
+selection_to_brush_menuitem_click (GtkMenuItem *menuitem) {
+	record_event("command tobrush");
+	if(!selection_active) return;
+	if(selection_floating) {
+		capture_brush_stamp(floating_pixels, selection_width, selection_width, selection_height);
+	}
+	else {
+		capture_brush_stamp(VGA_screen + ((size_t) selection_y * imageWidth) + selection_x, imageWidth, selection_width, selection_height);
+	}
+	gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM (brushShapeMenuItems[BRUSH_SHAPE_STAMP - BRUSH_SHAPE_ROUND]), TRUE);
+	gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM (drawToolMenuItem), TRUE);
+}
+
+/*
+ Flips, rotates or scales the selection, or the whole image if nothing is selected. user_data holds the TRANSFORM_ value.
+ The angle (degrees) or the new size (a factor or WIDTHxHEIGHT) is read from the transform field.
+*/
+void
+transform_menuitem_click (GtkMenuItem *menuitem,
+               gpointer  user_data)
+{
+	int transform = GPOINTER_TO_INT(user_data);
+	std::string parameter = gtk_entry_get_text(GTK_ENTRY (transformField));
+	record_event("transform %d %s", transform, parameter.c_str());
+	int width = selection_active ? selection_width : imageWidth;
+	int height = selection_active ? selection_height : imageHeight;
+	int newWidth = 0;
+	int newHeight = 0;
+	double angle = 0;
+
+	if(transform == TRANSFORM_ROTATE_ANGLE && !parse_angle(parameter, angle)) {
+		std::cout << "Type the angle in degrees into the transform field." << std::endl;
+		return;
+	}
+	if(transform == TRANSFORM_SCALE && !parse_scale(parameter, width, height, newWidth, newHeight)) {
+		std::cout << "Type the scale factor or the new size (eg. 160x100) into the transform field." << std::endl;
+		return;
+	}
+
+	transformed_size(transform, width, height, angle, newWidth, newHeight);
+	if(selection_active && (long long) newWidth * newHeight > 64000) {
+		std::cout << "The transformed selection would be larger than 64000 pixels." << std::endl;
+		return;
+	}
+	if((long long) newWidth * newHeight > max_image_pixels) {
+		std::cout << "The transformed image would be larger than " << max_image_pixels << " pixels." << std::endl;
+		return;
+	}
+
+	std::vector<unsigned char> result;
+	if(selection_active) {
+		if(!selection_floating) lift_selection();
+		transform_image(transform, floating_pixels, selection_width, selection_width, selection_height, result, newWidth, newHeight, angle, transparent_color);
+		memcpy(floating_pixels, result.data(), newWidth * newHeight);
+		// The selection stays centered on the same spot.
+		set_selection_rect(selection_x + ((selection_width - newWidth) / 2), selection_y + ((selection_height - newHeight) / 2), newWidth, newHeight);
+	}
+	else {
+		transform_image(transform, VGA_screen, imageWidth, imageWidth, imageHeight, result, newWidth, newHeight, angle, brush2_color);
+		put_image_to_canvas(result.data(), newWidth, newHeight);
+	}
+}
+
+/*
+ Asset browser
+
+ The browser window lists the .VGA, .PIC and .IMG files of a directory as thumbnails.
+ Thumbnails are decoded by a pool of worker threads. The rows that are visible in the browser are decoded first.
+ Decoded thumbnails are kept as palette indices, both in an in-memory LRU cache and in an on-disk cache
+ that is keyed by the path, modification time (with nanoseconds) and size of the file. On disk, each image has one cache file
+ that is named after its path, so a thumbnail of a changed file replaces the old one. The colors come from the palette of an .IMG file,
+ from a .PAL file with the same name next to the image, or from the palette of the editor.
+*/
+struct Thumbnail {
+	int width;
+	int height;
+	bool hasPalette; // Has the image file its own palette (.IMG)
+	unsigned char palette[768]; // 6-bit VGA values, if hasPalette
+	std::vector<unsigned char> pixels;
+};
+
+struct ThumbnailResult {
+	int generation; // browser_generation of the directory listing that the thumbnail belongs to
+	int index; // Row in browser_store
+	int width;
+	int height;
+	guchar *rgb;
+};
+
+std::mutex thumbnail_mutex; // Guards the queue, the browser listing and the worker state
+std::condition_variable thumbnail_wakeup;
+std::deque<int> thumbnail_queue; // Rows of browser_store that still need a thumbnail
+std::deque<int> thumbnail_visible_queue; // Rows that are visible in the browser, decoded before thumbnail_queue
+std::vector<std::thread> thumbnail_workers;
+bool thumbnail_workers_quit = false;
+bool thumbnail_prune_pending = false; // A worker should prune the on-disk cache before decoding more thumbnails
+int browser_generation = 0; // Incremented whenever the listing changes, so that results for an old listing are dropped
+std::vector<std::string> browser_paths;
+std::vector<char> browser_thumbnail_state;
+unsigned char browser_palette[768]; // Editor palette (6-bit VGA values) for images that have no palette of their own
+
+std::mutex thumbnail_cache_mutex; // Guards the in-memory cache
+std::list<std::string> thumbnail_lru; // Cache keys, most recently used first
+std::unordered_map<std::string, std::pair<Thumbnail, std::list<std::string>::iterator>> thumbnail_memory_cache;
+std::string thumbnail_cache_directory; // Set once before the workers are started, and only read after that
+
+GtkWidget *browserWindow = NULL;
+GtkWidget *browserIconView;
+GtkListStore *browser_store;
+GdkPixbuf *thumbnail_placeholder = NULL;
+
+std::string thumbnail_disk_cache_path(const std::string &path) {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.thm", (unsigned long long) std::hash<std::string>()(path));
+	return thumbnail_cache_directory + "/" + name;
+}
+
+// Keeps at most thumbnail_disk_cache_size thumbnail files on disk by removing the ones that were written longest ago.
+void prune_thumbnail_disk_cache() {
+	DIR *dir = opendir(thumbnail_cache_directory.c_str());
+	if(dir == NULL) return;
+	std::vector<std::pair<time_t, std::string>> files;
+	struct dirent *entry;
+	while((entry = readdir(dir)) != NULL) {
+		std::string name = entry->d_name;
+		struct stat info;
+		if(name.length() < 4 || name.compare(name.length() - 4, 4, ".thm") != 0) continue;
+		if(stat((thumbnail_cache_directory + "/" + name).c_str(), &info) == 0) files.push_back(std::make_pair(info.st_mtime, name));
+	}
+	closedir(dir);
+	if(files.size() <= thumbnail_disk_cache_size) return;
+	std::sort(files.begin(), files.end());
+	// Some room is left free, so that the directory isn't listed again after every new thumbnail.
+	size_t removed = files.size() - ((thumbnail_disk_cache_size * 3) / 4);
+	for(size_t file = 0; file < removed; file++) remove((thumbnail_cache_directory + "/" + files[file].second).c_str());
+}
+
+bool read_thumbnail_from_disk(const std::string &path, const std::string &key, Thumbnail &thumbnail) {
+	std::ifstream cachefile(thumbnail_disk_cache_path(path), std::ios::in|std::ios::binary);
+	if(!cachefile) return false;
+	unsigned char header[9];
+	if(!cachefile.read((char*) header, 9) || memcmp(header, "JTHM", 4) != 0) return false;
+	int keyLength = header[4] + (header[5] * 256);
+	std::string storedKey(keyLength, 0);
+	cachefile.read(&storedKey[0], keyLength);
+	if(storedKey != key) return false; // The file has changed, or another file has the same hash
+	thumbnail.width = header[6];
+	thumbnail.height = header[7];
+	thumbnail.hasPalette = header[8];
+	if(thumbnail.hasPalette) cachefile.read((char*) thumbnail.palette, 768);
+	thumbnail.pixels.resize(thumbnail.width * thumbnail.height);
+	cachefile.read((char*) thumbnail.pixels.data(), thumbnail.pixels.size());
+	return !cachefile.fail();
+}
+
+void write_thumbnail_to_disk(const std::string &imagePath, const std::string &key, const Thumbnail &thumbnail) {
+	std::string path = thumbnail_disk_cache_path(imagePath);
+	// Written under a temporary name first, so that another worker never reads a half-written file.
+	std::string temporaryPath = path + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+	std::ofstream cachefile(temporaryPath, std::ios::out|std::ios::binary|std::ios::trunc);
+	if(!cachefile.is_open()) return;
+	unsigned char header[9] = { 'J', 'T', 'H', 'M', (unsigned char)(key.length() % 256), (unsigned char)(key.length() / 256),
+		(unsigned char) thumbnail.width, (unsigned char) thumbnail.height, (unsigned char) thumbnail.hasPalette };
+	cachefile.write((const char*) header, 9);
+	cachefile.write(key.data(), key.length());
+	if(thumbnail.hasPalette) cachefile.write((const char*) thumbnail.palette, 768);
+	cachefile.write((const char*) thumbnail.pixels.data(), thumbnail.pixels.size());
+	cachefile.close();
+	if(cachefile.fail()) remove(temporaryPath.c_str());
+	else rename(temporaryPath.c_str(), path.c_str());
+}
+
+// Decodes an image file and scales it down to fit in thumbnail_width x thumbnail_height.
+bool decode_thumbnail(const std::string &path, Thumbnail &thumbnail) {
+	PooledBuffer pixels;
+	int width, height;
+	if(!read_image_file(path.c_str(), pixels, width, height, thumbnail.palette, thumbnail.hasPalette)) return false;
+	double scale = std::min((double) thumbnail_width / width, (double) thumbnail_height / height);
+	if(scale > 1) scale = 1;
+	thumbnail.width = std::max(1, (int) lround(width * scale));
+	thumbnail.height = std::max(1, (int) lround(height * scale));
+	transform_image(TRANSFORM_SCALE, pixels.data(), width, width, height, thumbnail.pixels, thumbnail.width, thumbnail.height, 0, 0);
+	return true;
+}
+
+// Finds the thumbnail of a file from the caches, or decodes it and stores it in both caches.
+bool get_thumbnail(const std::string &path, Thumbnail &thumbnail) {
+	struct stat info;
+	if(stat(path.c_str(), &info) != 0) return false;
+	// The nanoseconds matter: a file that is rewritten within the same second often keeps its size (every .VGA file is 64000 bytes).
+	std::string key = path + "|" + std::to_string((long long) info.st_mtim.tv_sec) + "." + std::to_string((long long) info.st_mtim.tv_nsec) + "|" + std::to_string((long long) info.st_size);
+
+	{
+		std::lock_guard<std::mutex> lock(thumbnail_cache_mutex);
+		auto cached = thumbnail_memory_cache.find(key);
+		if(cached != thumbnail_memory_cache.end()) {
+			thumbnail_lru.splice(thumbnail_lru.begin(), thumbnail_lru, cached->second.second);
+			thumbnail = cached->second.first;
+			return true;
+		}
+	}
+
+	if(!read_thumbnail_from_disk(path, key, thumbnail)) {
+		if(!decode_thumbnail(path, thumbnail)) return false;
+		write_thumbnail_to_disk(path, key, thumbnail);
+	}
+
+	std::lock_guard<std::mutex> lock(thumbnail_cache_mutex);
+	if(thumbnail_memory_cache.find(key) == thumbnail_memory_cache.end()) {
+		thumbnail_lru.push_front(key);
+		thumbnail_memory_cache[key] = std::make_pair(thumbnail, thumbnail_lru.begin());
+		if(thumbnail_lru.size() > thumbnail_memory_cache_size) {
+			thumbnail_memory_cache.erase(thumbnail_lru.back());
+			thumbnail_lru.pop_back();
+		}
+	}
+	return true;
+}
+
+// Reads the .PAL file that has the same name as the image, if there is one.
+bool read_sibling_palette(const std::string &path, unsigned char *palette) {
+	size_t dot = path.find_last_of('.');
+	if(dot == std::string::npos) return false;
+	const char *extensions[] = { ".PAL", ".pal", ".Pal" };
+	for(int extension = 0; extension < 3; extension++) {
+		std::ifstream palettefile(path.substr(0, dot) + extensions[extension], std::ios::in|std::ios::binary);
+		if(palettefile && palettefile.read((char*) palette, 768)) return true;
+	}
+	return false;
+}
+
+void free_thumbnail_rgb(guchar *pixels, gpointer data) {
+	free(pixels);
+}
+
+// Runs in the main thread: shows a finished thumbnail in the browser.
+gboolean thumbnail_ready(gpointer user_data) {
+	ThumbnailResult *result = (ThumbnailResult*) user_data;
+	if(browserWindow != NULL && result->generation == browser_generation) {
+		GdkPixbuf *thumbnailPixbuf = gdk_pixbuf_new_from_data (result->rgb, GDK_COLORSPACE_RGB, false, 8, result->width, result->height, result->width * 3, free_thumbnail_rgb, NULL);
+		GtkTreeIter iter;
+		if(gtk_tree_model_iter_nth_child(GTK_TREE_MODEL (browser_store), &iter, NULL, result->index)) {
+			gtk_list_store_set(browser_store, &iter, 0, thumbnailPixbuf, -1);
+		}
+		g_object_unref(thumbnailPixbuf);
+	}
+	else free(result->rgb);
+	delete result;
+	return FALSE;
+}
+
+void thumbnail_worker() {
+	std::unique_lock<std::mutex> lock(thumbnail_mutex);
+	while(true) {
+		thumbnail_wakeup.wait(lock, []{ return thumbnail_workers_quit || thumbnail_prune_pending || !thumbnail_queue.empty() || !thumbnail_visible_queue.empty(); });
+		if(thumbnail_workers_quit) return;
+		if(thumbnail_prune_pending) {
+			// Listing a large cache takes a while, so it is done here and not in the GTK thread.
+			thumbnail_prune_pending = false;
+			lock.unlock();
+			prune_thumbnail_disk_cache();
+			lock.lock();
+			continue;
+		}
+		std::deque<int> &queue = thumbnail_visible_queue.empty() ? thumbnail_queue : thumbnail_visible_queue;
+		int index = queue.front();
+		queue.pop_front();
+		if(browser_thumbnail_state[index] != THUMBNAIL_QUEUED) continue;
+		browser_thumbnail_state[index] = THUMBNAIL_DECODING;
+		int generation = browser_generation;
+		std::string path = browser_paths[index];
+		unsigned char palette[768];
+		memcpy(palette, browser_palette, 768);
+		lock.unlock();
+
+		Thumbnail thumbnail;
+		ThumbnailResult *result = NULL;
+		if(get_thumbnail(path, thumbnail)) {
+			if(thumbnail.hasPalette) memcpy(palette, thumbnail.palette, 768);
+			else read_sibling_palette(path, palette);
+			result = new ThumbnailResult;
+			result->generation = generation;
+			result->index = index;
+			result->width = thumbnail.width;
+			result->height = thumbnail.height;
+			result->rgb = (guchar*) malloc(thumbnail.pixels.size() * 3);
+			for(unsigned int pos = 0; pos < thumbnail.pixels.size(); pos++) {
+				result->rgb[(pos * 3) + 0] = palette[(thumbnail.pixels[pos] * 3) + 0] * 4;
+				result->rgb[(pos * 3) + 1] = palette[(thumbnail.pixels[pos] * 3) + 1] * 4;
+				result->rgb[(pos * 3) + 2] = palette[(thumbnail.pixels[pos] * 3) + 2] * 4;
+			}
+		}
+
+		lock.lock();
+		if(generation == browser_generation) browser_thumbnail_state[index] = THUMBNAIL_DONE;
+		if(result != NULL) g_idle_add(thumbnail_ready, result);
+	}
+}
+
+void start_thumbnail_workers() {
+	if(!thumbnail_workers.empty()) return;
+	int threads = std::max(2, (int) std::thread::hardware_concurrency());
+	for(int worker = 0; worker < threads; worker++) {
+		thumbnail_workers.emplace_back(thumbnail_worker);
+	}
+}
+
+void stop_thumbnail_workers() {
+	{
+		std::lock_guard<std::mutex> lock(thumbnail_mutex);
+		thumbnail_workers_quit = true;
+	}
+	thumbnail_wakeup.notify_all();
+	for(unsigned int worker = 0; worker < thumbnail_workers.size(); worker++) {
+		thumbnail_workers[worker].join();
+	}
+	thumbnail_workers.clear();
+}
+
+/*
+ Makes the rows that are visible in the browser the next ones to be decoded. The visible queue is rebuilt on every call,
+ so scrolling doesn't pile up the same rows again. A row that is decoded from the visible queue is skipped when
+ it comes up in thumbnail_queue.
+*/
+void prioritize_visible_thumbnails() {
+	GtkTreePath *first;
+	GtkTreePath *last;
+	if(!gtk_icon_view_get_visible_range(GTK_ICON_VIEW (browserIconView), &first, &last)) return;
+	int firstIndex = gtk_tree_path_get_indices(first)[0];
+	int lastIndex = gtk_tree_path_get_indices(last)[0];
+	gtk_tree_path_free(first);
+	gtk_tree_path_free(last);
+	{
+		std::lock_guard<std::mutex> lock(thumbnail_mutex);
+		thumbnail_visible_queue.clear();
+		for(int index = firstIndex; index <= lastIndex; index++) {
+			if(browser_thumbnail_state[index] == THUMBNAIL_QUEUED) thumbnail_visible_queue.push_back(index);
+		}
+	}
+	thumbnail_wakeup.notify_all();
+}
+
+void
+browser_scrolled (GtkAdjustment *adjustment,
+               gpointer  user_data)
+{
+	prioritize_visible_thumbnails();
+}
+
+void
+browser_item_activated (GtkIconView *iconview,
+               GtkTreePath *path,
+               gpointer  user_data)
+{
+	std::string filename;
+	{
+		std::lock_guard<std::mutex> lock(thumbnail_mutex);
+		filename = browser_paths[gtk_tree_path_get_indices(path)[0]];
+	}
+	open_file(filename.c_str());
+}
+
+void
+browser_closed (GtkWidget *widget,
+               gpointer  user_data)
+{
+	std::lock_guard<std::mutex> lock(thumbnail_mutex);
+	browserWindow = NULL;
+	browser_generation++;
+	thumbnail_queue.clear();
+	thumbnail_visible_queue.clear();
+}
+
+// Lists the image files of a directory in the browser and queues their thumbnails.
+void browse_directory(const char *directory) {
+	std::vector<std::string> names;
+	DIR *dir = opendir(directory);
+	if(dir == NULL) {
+		std::cout << "Can't open directory " << directory << std::endl;
+		return;
+	}
+	struct dirent *entry;
+	while((entry = readdir(dir)) != NULL) {
+		int fileType = getFileType(entry->d_name);
+		if(fileType == FILE_EXTENSION_VGA || fileType == FILE_EXTENSION_PIC || fileType == FILE_EXTENSION_IMG) {
+			names.push_back(entry->d_name);
+		}
+	}
+	closedir(dir);
+	std::sort(names.begin(), names.end());
+
+	if(thumbnail_cache_directory.length() == 0) {
+		thumbnail_cache_directory = std::string(g_get_user_cache_dir()) + "/JoonasImageEditor/thumbnails";
+		g_mkdir_with_parents(thumbnail_cache_directory.c_str(), 0755);
+	}
+	if(thumbnail_placeholder == NULL) {
+		static guchar placeholder[thumbnail_width * thumbnail_height * 3];
+		memset(placeholder, 0x40, sizeof(placeholder));
+		thumbnail_placeholder = gdk_pixbuf_new_from_data (placeholder, GDK_COLORSPACE_RGB, false, 8, thumbnail_width, thumbnail_height, thumbnail_width * 3, NULL, NULL);
+	}
+
+	gtk_list_store_clear(browser_store);
+	{
+		std::lock_guard<std::mutex> lock(thumbnail_mutex);
+		browser_generation++;
+		thumbnail_queue.clear();
+		thumbnail_visible_queue.clear();
+		browser_paths.clear();
+		for(unsigned int index = 0; index < names.size(); index++) {
+			browser_paths.push_back(std::string(directory) + "/" + names[index]);
+			thumbnail_queue.push_back(index);
+		}
+		browser_thumbnail_state.assign(names.size(), THUMBNAIL_QUEUED);
+		thumbnail_prune_pending = true;
+		for(int pos = 0; pos < 768; pos++) browser_palette[pos] = VGA_palette_registers[pos] / 4;
+	}
+	for(unsigned int index = 0; index < names.size(); index++) {
+		GtkTreeIter iter;
+		gtk_list_store_append(browser_store, &iter);
+		gtk_list_store_set(browser_store, &iter, 0, thumbnail_placeholder, 1, names[index].c_str(), -1);
+	}
+	start_thumbnail_workers();
+	thumbnail_wakeup.notify_all();
+}
+
+void
+browse_menuitem_click (GtkMenuItem *menuitem) {
+	GtkWidget *dialog = gtk_file_chooser_dialog_new ("Browse Directory",
+		NULL,
+		GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER,
+		("_Cancel"),
+		GTK_RESPONSE_CANCEL,
+		("_Browse"),
+		GTK_RESPONSE_ACCEPT,
+		NULL);
+
+	if (gtk_dialog_run (GTK_DIALOG (dialog)) == GTK_RESPONSE_ACCEPT)
+	{
+		char *directory = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER (dialog));
+		if(browserWindow == NULL) {
+			browserWindow = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+			gtk_window_set_title (GTK_WINDOW (browserWindow), "Browse Images");
+			gtk_window_set_default_size (GTK_WINDOW (browserWindow), 720, 480);
+			g_signal_connect (browserWindow, "destroy", G_CALLBACK (browser_closed), NULL);
+
+			GtkWidget *scrolled = gtk_scrolled_window_new (NULL, NULL);
+			gtk_scrolled_window_set_policy (GTK_SCROLLED_WINDOW (scrolled), GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+			gtk_container_add (GTK_CONTAINER (browserWindow), scrolled);
+
+			browser_store = gtk_list_store_new (2, GDK_TYPE_PIXBUF, G_TYPE_STRING);
+			browserIconView = gtk_icon_view_new_with_model (GTK_TREE_MODEL (browser_store));
+			g_object_unref (browser_store);
+			gtk_icon_view_set_pixbuf_column (GTK_ICON_VIEW (browserIconView), 0);
+			gtk_icon_view_set_text_column (GTK_ICON_VIEW (browserIconView), 1);
+			gtk_icon_view_set_item_width (GTK_ICON_VIEW (browserIconView), thumbnail_width + 16);
+			g_signal_connect (browserIconView, "item-activated", G_CALLBACK (browser_item_activated), NULL);
+			gtk_container_add (GTK_CONTAINER (scrolled), browserIconView);
+
+			g_signal_connect (gtk_scrolled_window_get_vadjustment (GTK_SCROLLED_WINDOW (scrolled)), "value-changed", G_CALLBACK (browser_scrolled), NULL);
+			gtk_widget_show_all (browserWindow);
+		}
+		browse_directory(directory);
+		gtk_window_present (GTK_WINDOW (browserWindow));
+		g_free (directory);
+	}
+	gtk_widget_destroy (dialog);
+}
+
+/*
+ Headless batch path: JoonasImageEditor --batch INPUT OUTPUT [operations...]
+ The operations are applied in the given order and no window is opened. Returns the exit code of the program.
+*/
+int run_batch(int argc, char *argv[]) {
+	if(argc < 4) {
+		std::cout << "Usage: JoonasImageEditor --batch INPUT OUTPUT [flipx] [flipy] [rot90] [rot270] [rotate=DEGREES] [scale=FACTOR|WIDTHxHEIGHT]" << std::endl;
+		return 1;
+	}
+	PooledBuffer source;
+	std::vector<unsigned char> result;
+	int width, height;
+	unsigned char palette[768];
+	bool hasPalette;
+	if(!read_image_file(argv[2], source, width, height, palette, hasPalette)) {
+		std::cout << "Can't read image file " << argv[2] << std::endl;
+		return 1;
+	}
+	if(!hasPalette) {
+		for(int pos = 0; pos < 768; pos++) palette[pos] = default_VGA_palette_registers[pos] / 4;
+	}
+	std::vector<unsigned char> pixels(source.data(), source.data() + source.size());
+
+	for(int arg = 4; arg < argc; arg++) {
+		std::string operation = argv[arg];
+		int transform = 0;
+		int newWidth = 0;
+		int newHeight = 0;
+		double angle = 0;
+		if(operation == "flipx") transform = TRANSFORM_FLIP_HORIZONTAL;
+		else if(operation == "flipy") transform = TRANSFORM_FLIP_VERTICAL;
+		else if(operation == "rot90") transform = TRANSFORM_ROTATE_CLOCKWISE;
+		else if(operation == "rot270") transform = TRANSFORM_ROTATE_COUNTERCLOCKWISE;
+		else if(operation.compare(0, 7, "rotate=") == 0 && parse_angle(operation.substr(7), angle)) {
+			transform = TRANSFORM_ROTATE_ANGLE;
+		}
+		else if(operation.compare(0, 6, "scale=") == 0 && parse_scale(operation.substr(6), width, height, newWidth, newHeight)) {
+			transform = TRANSFORM_SCALE;
+		}
+		else {
+			std::cout << "Unknown operation: " << operation << std::endl;
+			return 1;
+		}
+		transformed_size(transform, width, height, angle, newWidth, newHeight);
+		if((long long) newWidth * newHeight > max_image_pixels) {
+			std::cout << operation << " would make a " << newWidth << "x" << newHeight << " image, the limit is " << max_image_pixels << " pixels." << std::endl;
+			return 1;
+		}
+		transform_image(transform, pixels.data(), width, width, height, result, newWidth, newHeight, angle, transparent_color);
+		pixels.swap(result);
+		width = newWidth;
+		height = newHeight;
+	}
+
+	if(!write_image_file(argv[3], pixels.data(), width, height, palette)) {
+		std::cout << "Can't write " << width << "x" << height << " image to " << argv[3] << " (.VGA and .IMG files must be 320x200)" << std::endl;
+		return 1;
+	}
+	std::cout << "Saved " << width << "x" << height << " image to " << argv[3] << std::endl;
+	return 0;
+}
+
+/*
+ Delta animation (.DLT)
 
-		int fileType = getFileType(filename);
+ The file starts with the 10-byte header "JDLT", width, height and number of frames (16-bit little-endian values).
+ Each frame follows as a 32-bit little-endian byte count and the frame data, which only describes how the frame differs
+ from the previous one. The frame before the first one is all color 0, so the first frame is stored like any other frame.
 
-		std::ifstream sourcefile(filename, std::ios::in|std::ios::binary|std::ios::ate);
-		if(sourcefile)
-		{
-			if(fileType == FILE_EXTENSION_PAL) {
-				sourcefile.seekg (0, std::ios::beg);
-				sourcefile.read (loadedPalette, 768);
-			}
-			else {
-				loadedSize = sourcefile.tellg();
-				sourcefile.seekg (0, std::ios::beg);
-				sourcefile.read (loadedFile, loadedSize);
-			}
+ Frame data, FLI-style: the first changed row and the number of rows up to the last changed row (16-bit each),
+ then for each of those rows a 16-bit packet count and the packets. A packet is a byte of pixels to skip, then a signed
+ size byte: a positive size is followed by that many pixels to copy, a negative size by one pixel that is repeated -size times.
+ Skips longer than 255 pixels are split with packets that have size 0. An unchanged frame is just the 4 bytes 0, 0, 0, 0.
+*/
+void put_delta_word(std::vector<unsigned char> &out, int value) {
+	out.push_back(value & 255);
+	out.push_back((value >> 8) & 255);
+}
+
+// Emits the packets for the changed pixels x ... end - 1 of a row. skip is the number of unchanged pixels before x.
+void encode_delta_span(const unsigned char *row, int x, int end, int skip, std::vector<unsigned char> &out, int &packets) {
+	while(skip > 255) {
+		out.push_back(255);
+		out.push_back(0);
+		packets++;
+		skip -= 255;
+	}
+	while(x < end) {
+		int repeat = 1;
+		while(x + repeat < end && repeat < 128 && row[x + repeat] == row[x]) repeat++;
+		out.push_back(skip);
+		skip = 0;
+		packets++;
+		// A repeat packet takes 2 bytes, so it only pays off from 3 equal pixels on.
+		if(repeat >= 3) {
+			out.push_back((unsigned char)(-repeat));
+			out.push_back(row[x]);
+			x += repeat;
+			continue;
 		}
-		else
-		{
-			std::cout << "Source file not found!" << std::endl;
+		int literal = 0;
+		while(x + literal < end && literal < 127) {
+			if(x + literal + 2 < end && row[x + literal] == row[x + literal + 1] && row[x + literal] == row[x + literal + 2]) break;
+			literal++;
 		}
-		sourcefile.close();
+		out.push_back(literal);
+		out.insert(out.end(), row + x, row + x + literal);
+		x += literal;
+	}
+}
 
-		if(fileType == FILE_EXTENSION_VGA) {
-			for(int pos = 0; pos < 64000; pos++) {
-				VGA_screen[pos] = loadedFile[pos];
+// Encodes the difference between the frames previous and current (width x height pixels each) and appends it to out.
+void encode_delta_frame(const unsigned char *previous, const unsigned char *current, int width, int height, std::vector<unsigned char> &out) {
+	int firstLine = 0;
+	while(firstLine < height && memcmp(previous + ((size_t) firstLine * width), current + ((size_t) firstLine * width), width) == 0) firstLine++;
+	int lastLine = height - 1;
+	while(lastLine >= firstLine && memcmp(previous + ((size_t) lastLine * width), current + ((size_t) lastLine * width), width) == 0) lastLine--;
+	if(firstLine > lastLine) {
+		put_delta_word(out, 0);
+		put_delta_word(out, 0);
+		return;
+	}
+	put_delta_word(out, firstLine);
+	put_delta_word(out, lastLine - firstLine + 1);
+	for(int y = firstLine; y <= lastLine; y++) {
+		const unsigned char *before = previous + ((size_t) y * width);
+		const unsigned char *row = current + ((size_t) y * width);
+		size_t countPosition = out.size();
+		put_delta_word(out, 0);
+		int packets = 0;
+		int x = 0;
+		while(x < width) {
+			int start = x;
+			while(x < width && before[x] == row[x]) x++;
+			if(x == width) break;
+			// The changed span ends where 3 unchanged pixels in a row would cost more to copy than a new packet.
+			int end = x;
+			while(end < width) {
+				if(before[end] != row[end]) end++;
+				else if((end + 1 < width && before[end + 1] != row[end + 1]) || (end + 2 < width && before[end + 2] != row[end + 2])) end++;
+				else break;
 			}
-			imageWidth = 320;
-			imageHeight = 200;
-			std::cout << "Loaded 256-color VGA picture file." << std::endl;
-			put_vga_picture_to_screen();
+			encode_delta_span(row, x, end, x - start, out, packets);
+			x = end;
 		}
+		out[countPosition] = packets & 255;
+		out[countPosition + 1] = (packets >> 8) & 255;
+	}
+}
 
-		if(fileType == FILE_EXTENSION_PAL) {
-			std::cout << "Loaded VGA palette file." << std::endl;
-			for(int pos = 0; pos < 768; pos++)
-			{
-				int color = loadedPalette[pos];
-				if(color < 0) color += 256;
-				color *= 4;
-				VGA_palette_registers[pos] = color;
+/*
+ Reference decoder: applies one frame of delta data to frame, which holds the previous frame.
+ Returns false if the data is damaged or doesn't fit the frame size.
+*/
+bool decode_delta_frame(const unsigned char *data, size_t size, unsigned char *frame, int width, int height) {
+	const unsigned char *end = data + size;
+	if(size < 4) return false;
+	int firstLine = data[0] + (data[1] * 256);
+	int lineCount = data[2] + (data[3] * 256);
+	data += 4;
+	if(firstLine + lineCount > height) return false;
+	for(int y = firstLine; y < firstLine + lineCount; y++) {
+		if(end - data < 2) return false;
+		int packets = data[0] + (data[1] * 256);
+		data += 2;
+		unsigned char *row = frame + ((size_t) y * width);
+		int x = 0;
+		for(int packet = 0; packet < packets; packet++) {
+			if(end - data < 2) return false;
+			x += data[0];
+			int count = (signed char) data[1];
+			data += 2;
+			if(count >= 0) {
+				if(x + count > width || end - data < count) return false;
+				memcpy(row + x, data, count);
+				data += count;
+				x += count;
 			}
-			// After loading the palette, we must update the colors of the image so that they correspond to the current VGA palette values.
-			put_vga_picture_to_screen();
-			create_palette_toolbar();
-			int colorR = VGA_palette_registers[(brush1_color * 3) + 0];
-			int colorG = VGA_palette_registers[(brush1_color * 3) + 1];
-			int colorB = VGA_palette_registers[(brush1_color * 3) + 2];
-			gtk_range_set_value(GTK_RANGE (slider), (colorR / 4));
-			gtk_range_set_value(GTK_RANGE (slider2), (colorG / 4));
-			gtk_range_set_value(GTK_RANGE (slider3), (colorB / 4));
-		}
-
-		if(fileType == FILE_EXTENSION_PIC) {
-			int wb0 = loadedFile[0];
-			int wb1 = loadedFile[1];
-			int hb0 = loadedFile[2];
-			int hb1 = loadedFile[3];
-			if(wb0 < 0) wb0 += 256;
-			if(wb1 < 0) wb1 += 256;
-			if(hb0 < 0) hb0 += 256;
-			if(hb1 < 0) hb1 += 256;
-			int width = (wb1 * 256) + wb0;
-			int height = (hb1 * 256) + hb0;
-			for(int y = 0; y < height; y++) {
-				for(int x = 0; x < width; x++) {
-					VGA_screen[(y * 320) + x] = loadedFile[4 + (y * width) + x];
-				}
+			else {
+				if(x - count > width || data == end) return false;
+				memset(row + x, *data, -count);
+				data++;
+				x -= count;
 			}
-			std::cout << "Loaded 256-color VGA image with the size: " << width << "x" << height << std::endl;
-			set_size_of_drawingarea(width, height);
 		}
-		g_free (filename);
 	}
-	gtk_widget_destroy (dialog);
+	return data == end;
+}
+
+/*
+ Writes the frames as a delta animation, then reads the file back with the reference decoder and prints
+ the size of each frame and the time it took to decode. Returns false if the file can't be written or doesn't decode.
+*/
+bool export_delta_animation(const char *filename, const std::vector<const unsigned char*> &frames, int width, int height) {
+	if(frames.empty() || width > 65535 || height > 65535 || frames.size() > 65535) return false;
+	std::vector<unsigned char> blank((size_t) width * height, 0);
+	std::vector<unsigned char> out;
+	out.insert(out.end(), { 'J', 'D', 'L', 'T' });
+	put_delta_word(out, width);
+	put_delta_word(out, height);
+	put_delta_word(out, frames.size());
+	for(unsigned int frame = 0; frame < frames.size(); frame++) {
+		size_t sizePosition = out.size();
+		out.resize(out.size() + 4);
+		encode_delta_frame((frame == 0) ? blank.data() : frames[frame - 1], frames[frame], width, height, out);
+		size_t chunkSize = out.size() - sizePosition - 4;
+		for(int pos = 0; pos < 4; pos++) out[sizePosition + pos] = (chunkSize >> (pos * 8)) & 255;
+	}
+	std::ofstream savedfile (filename, std::ios::out|std::ios::binary|std::ios::trunc);
+	if (!savedfile.is_open()) return false;
+	savedfile.write((const char*) out.data(), out.size());
+	savedfile.close();
+	if(savedfile.fail()) return false;
+
+	std::ifstream sourcefile(filename, std::ios::in|std::ios::binary|std::ios::ate);
+	if(!sourcefile) return false;
+	std::streamoff fileSize = sourcefile.tellg();
+	if(fileSize < 10) return false; // Can't be read back (for example a pipe), or it's too short
+	std::vector<unsigned char> file((size_t) fileSize);
+	sourcefile.seekg (0, std::ios::beg);
+	if(!sourcefile.read((char*) file.data(), file.size()) || file.size() < 10 || memcmp(file.data(), "JDLT", 4) != 0) return false;
+
+	size_t fullFrameSize = (size_t) width * height;
+	char line[128];
+	std::cout << "frame    bytes    decode us" << std::endl;
+	size_t position = 10;
+	size_t largestFrame = 0;
+	double slowestDecode = 0;
+	double totalDecode = 0;
+	for(unsigned int frame = 0; frame < frames.size(); frame++) {
+		if(file.size() - position < 4) return false;
+		size_t chunkSize = file[position] + (file[position + 1] << 8) + (file[position + 2] << 16) + ((size_t) file[position + 3] << 24);
+		position += 4;
+		if(file.size() - position < chunkSize) return false;
+		auto start = std::chrono::steady_clock::now();
+		bool decoded = decode_delta_frame(file.data() + position, chunkSize, blank.data(), width, height);
+		double microseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+		if(!decoded || memcmp(blank.data(), frames[frame], fullFrameSize) != 0) {
+			std::cout << "Frame " << frame << " doesn't decode to the original image!" << std::endl;
+			return false;
+		}
+		position += chunkSize;
+		largestFrame = std::max(largestFrame, chunkSize + 4);
+		slowestDecode = std::max(slowestDecode, microseconds);
+		totalDecode += microseconds;
+		snprintf(line, sizeof(line), "%5u %8zu %12.1f", frame, chunkSize + 4, microseconds);
+		std::cout << line << std::endl;
+	}
+	snprintf(line, sizeof(line), "Total %zu bytes for %zu frames (%.1f%% of %zu bytes as full frames)", file.size(), frames.size(), 100.0 * file.size() / (fullFrameSize * frames.size()), fullFrameSize * frames.size());
+	std::cout << line << std::endl;
+	snprintf(line, sizeof(line), "Largest frame %zu bytes, %.1f KB/s at %d frames per second", largestFrame, largestFrame * delta_playback_frame_rate / 1024.0, delta_playback_frame_rate);
+	std::cout << line << std::endl;
+	snprintf(line, sizeof(line), "Decode time: average %.1f us, slowest %.1f us (one frame lasts %.0f us)", totalDecode / frames.size(), slowestDecode, 1000000.0 / delta_playback_frame_rate);
+	std::cout << line << std::endl;
+	return true;
 }
 
+/*
+ Headless delta export: JoonasImageEditor --delta OUTPUT INPUT1 INPUT2 [INPUT3 ...]
+ Every input is one frame. Returns the exit code of the program.
+*/
+int run_delta(int argc, char *argv[]) {
+	if(argc < 4) {
+		std::cout << "Usage: JoonasImageEditor --delta OUTPUT INPUT1 INPUT2 [INPUT3 ...]" << std::endl;
+		return 1;
+	}
+	std::vector<std::unique_ptr<PooledBuffer>> images;
+	std::vector<const unsigned char*> frames;
+	int width = 0;
+	int height = 0;
+	for(int arg = 3; arg < argc; arg++) {
+		images.push_back(std::unique_ptr<PooledBuffer>(new PooledBuffer()));
+		int frameWidth, frameHeight;
+		unsigned char palette[768];
+		bool hasPalette;
+		if(!read_image_file(argv[arg], *images.back(), frameWidth, frameHeight, palette, hasPalette)) {
+			std::cout << "Can't read image file " << argv[arg] << std::endl;
+			return 1;
+		}
+		if(arg > 3 && (frameWidth != width || frameHeight != height)) {
+			std::cout << argv[arg] << " is " << frameWidth << "x" << frameHeight << ", the other frames are " << width << "x" << height << std::endl;
+			return 1;
+		}
+		width = frameWidth;
+		height = frameHeight;
+		frames.push_back(images.back()->data());
+	}
+	if(!export_delta_animation(argv[2], frames, width, height)) {
+		std::cout << "Can't write delta animation " << argv[2] << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+// Exports the open documents, in the order of the document selector, as the frames of a delta animation.
 void
-menuitem2click (GtkMenuItem *menuitem) {
-	GtkWidget *dialog;
-	GtkFileChooserAction action = GTK_FILE_CHOOSER_ACTION_SAVE;
-	gint res;
+export_delta_menuitem_click (GtkMenuItem *menuitem) {
+	drop_selection();
+	std::vector<const unsigned char*> frames;
+	for(unsigned int doc = 0; doc < documents.size(); doc++) {
+		if(documents[doc]->width != imageWidth || documents[doc]->height != imageHeight) {
+			std::cout << "All open documents must be " << imageWidth << "x" << imageHeight << " to export them as an animation." << std::endl;
+			return;
+		}
+		frames.push_back(documents[doc]->pixels.data());
+	}
 
-	dialog = gtk_file_chooser_dialog_new ("Save File",
+	GtkWidget *dialog = gtk_file_chooser_dialog_new ("Export Delta Animation",
 		NULL,
-		action,
+		GTK_FILE_CHOOSER_ACTION_SAVE,
 		("_Cancel"),
 		GTK_RESPONSE_CANCEL,
 		("_Save"),
 		GTK_RESPONSE_ACCEPT,
 		NULL);
-
-	res = gtk_dialog_run (GTK_DIALOG (dialog));
-	if (res == GTK_RESPONSE_ACCEPT)
+	if (gtk_dialog_run (GTK_DIALOG (dialog)) == GTK_RESPONSE_ACCEPT)
 	{
-		char *filename;
-		GtkFileChooser *chooser = GTK_FILE_CHOOSER (dialog);
-		filename = gtk_file_chooser_get_filename (chooser);
-
-		int fileType = getFileType(filename);
-		// .PAL file extension?
-		if(fileType == FILE_EXTENSION_PAL) {
-			std::cout << "saving pal file" << std::endl;
-			for(int pos = 0; pos < 768; pos++)
-			{
-				int val = VGA_palette_registers[pos];
-				if(val < 0) val += 256;
-				val /= 4;
-				loadedPalette[pos] = val;
-			}
-			std::ofstream savedfile (filename, std::ios::out|std::ios::binary|std::ios::ate);
-			if (savedfile.is_open())
-			{
-				savedfile.write(loadedPalette, 768);
-				savedfile.close();
-			}
-			else
-			{
-				std::cout << "Error creating file!" << std::endl;
-			}
-		}
-		// .VGA file extension?
-		if(fileType == FILE_EXTENSION_VGA) {
-			std::cout << "saving vga file" << std::endl;
-			std::ofstream savedfile (filename, std::ios::out|std::ios::binary|std::ios::ate);
-			if (savedfile.is_open())
-			{
-				savedfile.write(loadedFile, 64000);
-				savedfile.close();
-			}
-			else
-			{
-				std::cout << "Error creating file!" << std::endl;
-			}
-		}
-		// .PIC file extension?
-		if(fileType == FILE_EXTENSION_PIC) {
-			std::cout << "saving pic file" << std::endl;
-			int wb1 = imageWidth / 256;
-			int wb0 = imageWidth - (wb1 * 256);
-			int hb1 = imageHeight / 256;
-			int hb0 = imageHeight - (hb1 * 256);
-			std::cout << "wb0,wb1: " << wb0 << "," << wb1 << " hb0,hb1:" << hb0 << "," << hb1 << std::endl;
-			loadedFile[0] = wb0;
-			loadedFile[1] = wb1;
-			loadedFile[2] = hb0;
-			loadedFile[3] = hb1;
-			for(int y = 0; y < imageHeight; y++) {
-				for(int x = 0; x < imageWidth; x++) {
-					loadedFile[4 + (y * imageWidth) + x] = VGA_screen[(y * 320) + x];
-				}
-			}
-			loadedSize = (imageWidth * imageHeight) + 4;
-			std::ofstream savedfile (filename, std::ios::out|std::ios::binary|std::ios::ate);
-			if (savedfile.is_open())
-			{
-				savedfile.write(loadedFile, loadedSize);
-				savedfile.close();
-			}
-			else
-			{
-				std::cout << "Error creating file!" << std::endl;
-			}
+		char *filename = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER (dialog));
+		if(!export_delta_animation(filename, frames, imageWidth, imageHeight)) {
+			std::cout << "Error creating file!" << std::endl;
 		}
 		g_free (filename);
 	}
@@ -593,130 +2835,265 @@ menuitem2click (GtkMenuItem *menuitem) {
 }
 
 /*
- Call this with one of three values to change the value of R, G or B.
- 0 = change R
- 1 = change G
- 2 = change B
+ Replay
+
+ With --replay FILE, the recorded inputs are fed to the same handlers that GTK calls for live input, one input per
+ main loop iteration, and the time each handler takes is measured. The window still has to exist, so on a machine
+ without a display, run the replay under a virtual display:
+
+ xvfb-run ./JoonasImageEditor --replay strokes.log --budget-us 2000 --expect-hash 1234abcd5678ef90
+
+ When all inputs have been replayed, the timings per input type and a hash of the final image and palette are printed,
+ and the program exits. The --report file gets the time of every input (line in the recording, type, microseconds)
+ followed by the same summary. The exit code is 1 if the 95th percentile time of any input
+ type is over the --budget-us budget or if the hash differs from --expect-hash, so that a test script can catch regressions.
 */
-void change_palette_of_selected_color(int indexOfRorGorB, int pos)
-{
-	VGA_palette_registers[(brush1_color * 3) + indexOfRorGorB] = pos;
-	int pal_row = brush1_color / palette_square_cols;
-	int pal_square_index = pal_row * palette_square_cols;
-	int pal_square_x = (brush1_color - pal_square_index) * size_of_palette_square;
-	int pal_square_y = (drawingAreaHeight + (pal_row * size_of_palette_square));
-	put_palette_square_to_screen(pal_square_x, pal_square_y, brush1_color);
-	gtk_widget_queue_draw_area (da, pal_square_x, pal_square_y, size_of_palette_square, size_of_palette_square);
-	put_vga_picture_to_screen();
-	refresh_currently_selected_colors();
-}
+struct ReplayEvent {
+	int line; // Line number in the recording
+	std::string type;
+	std::string values;
+	long long time; // Processing time in microseconds
+};
 
-void
-slider_R_changed (GtkRange *range,
-               gpointer  user_data)
-{
-	int pos;
-	pos = gtk_range_get_value (GTK_RANGE (slider));
-	pos *= 4;
-	change_palette_of_selected_color(0, pos);
-}
-void
-slider_G_changed (GtkRange *range,
-               gpointer  user_data)
-{
-	int pos;
-	pos = gtk_range_get_value (GTK_RANGE (slider2));
-	pos *= 4;
-	change_palette_of_selected_color(1, pos);
-}
-void
-slider_B_changed (GtkRange *range,
-               gpointer  user_data)
-{
-	int pos;
-	pos = gtk_range_get_value (GTK_RANGE (slider3));
-	pos *= 4;
-	change_palette_of_selected_color(2, pos);
+std::vector<ReplayEvent> replay_events;
+unsigned int replay_position = 0;
+long long replay_budget = 0; // Microseconds, 0 = no budget
+std::string replay_expected_hash;
+std::string replay_report_path;
+int replay_exit_code = 0;
+
+// 64-bit FNV-1a hash of the size, the pixels and the palette of the image
+unsigned long long image_hash() {
+	unsigned long long hash = 14695981039346656037ULL;
+	auto add = [&hash](unsigned char byte) {
+		hash ^= byte;
+		hash *= 1099511628211ULL;
+	};
+	add(imageWidth % 256);
+	add(imageWidth / 256);
+	add(imageHeight % 256);
+	add(imageHeight / 256);
+	for(int y = 0; y < imageHeight; y++) {
+		for(int x = 0; x < imageWidth; x++) add(VGA_screen[((size_t) y * imageWidth) + x]);
+	}
+	for(int pos = 0; pos < 768; pos++) add(VGA_palette_registers[pos]);
+	return hash;
 }
 
-bool isNumeric(std::string givenText) {
-	bool isValid = true;
-	for(unsigned int pos = 0; pos < givenText.length(); pos++) {
-		if(givenText[pos] < '0' || givenText[pos] > '9') {
-			pos = givenText.length();
-			isValid = false;
+void dispatch_replay_event(ReplayEvent &event) {
+	std::istringstream values(event.values);
+	if(event.type == "motion") {
+		GdkEventMotion motion = {};
+		motion.type = GDK_MOTION_NOTIFY;
+		values >> motion.x >> motion.y >> motion.state;
+		motion_notify_event_cb(da, &motion, NULL);
+	}
+	else if(event.type == "press" || event.type == "release") {
+		GdkEventButton button = {};
+		button.type = (event.type == "press") ? GDK_BUTTON_PRESS : GDK_BUTTON_RELEASE;
+		values >> button.x >> button.y >> button.button;
+		if(event.type == "press") button_press_event_cb(da, &button, NULL);
+		else button_release_event_cb(da, &button, NULL);
+	}
+	else if(event.type == "slider") {
+		int index;
+		double value;
+		values >> index >> value;
+		GtkWidget *sliders[3] = { slider, slider2, slider3 };
+		if(index >= 0 && index < 3) gtk_range_set_value(GTK_RANGE (sliders[index]), value);
+	}
+	else if(event.type == "entry") {
+		std::string name;
+		values >> name;
+		std::string text;
+		values.get();
+		std::getline(values, text);
+		struct { const char *name; GtkWidget *field; void (*handler)(GtkEntry*, gpointer); } fields[] = {
+			{ "width", widthField, widthField_changed },
+			{ "height", heightField, heightField_changed },
+			{ "target", targetColorField, targetColorField_changed },
+			{ "brushsize", brushSizeField, brushSizeField_changed },
+			{ "transparent", transparentColorField, transparentColorField_changed }
+		};
+		for(unsigned int field = 0; field < sizeof(fields) / sizeof(fields[0]); field++) {
+			if(name == fields[field].name) {
+				gtk_entry_set_text(GTK_ENTRY (fields[field].field), text.c_str());
+				fields[field].handler(GTK_ENTRY (fields[field].field), NULL);
+			}
 		}
+		// The remap reads the source color from its own field, which has no handler of its own.
+		if(name == "source") gtk_entry_set_text(GTK_ENTRY (sourceColorField), text.c_str());
 	}
-	return isValid;
+	else if(event.type == "tool" || event.type == "shape" || event.type == "pattern") {
+		int value;
+		values >> value;
+		GtkWidget *item = NULL;
+		if(event.type == "tool") item = (value == TOOL_SELECT) ? selectToolMenuItem : drawToolMenuItem;
+		if(event.type == "shape" && value >= BRUSH_SHAPE_ROUND && value <= BRUSH_SHAPE_STAMP) item = brushShapeMenuItems[value - BRUSH_SHAPE_ROUND];
+		if(event.type == "pattern" && value >= 0 && value < number_of_brush_patterns) item = brushPatternMenuItems[value];
+		if(item != NULL) gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM (item), TRUE);
+	}
+	else if(event.type == "command") {
+		std::string command;
+		values >> command;
+		if(command == "cut") cut_menuitem_click(NULL);
+		if(command == "copy") copy_menuitem_click(NULL);
+		if(command == "paste") paste_menuitem_click(NULL);
+		if(command == "deselect") deselect_menuitem_click(NULL);
+		if(command == "tobrush") selection_to_brush_menuitem_click(NULL);
+		if(command == "new") new_menuitem_click(NULL);
+		if(command == "close") close_menuitem_click(NULL);
+	}
+	else if(event.type == "document") {
+		int index;
+		values >> index;
+		switch_document(index);
+	}
+	else if(event.type == "transform") {
+		int transform;
+		values >> transform;
+		std::string parameter;
+		values.get();
+		std::getline(values, parameter);
+		gtk_entry_set_text(GTK_ENTRY (transformField), parameter.c_str());
+		transform_menuitem_click(NULL, GINT_TO_POINTER (transform));
+	}
+	else if(event.type == "open") {
+		std::string filename;
+		values.get();
+		std::getline(values, filename);
+		open_file(filename.c_str());
+	}
+	else std::cout << "Unknown input on line " << event.line << ": " << event.type << std::endl;
 }
 
-void
-widthField_changed (GtkEntry *entry,
-               gpointer  user_data)
-{
-	std::string val = gtk_entry_get_text(GTK_ENTRY (widthField));
-	bool valid = isNumeric(val);
-	int newWidth;
-	if(valid) {
-		newWidth = stoi(val);
+void report_replay() {
+	std::ostringstream report;
+	std::vector<std::string> types;
+	for(unsigned int pos = 0; pos < replay_events.size(); pos++) {
+		if(std::find(types.begin(), types.end(), replay_events[pos].type) == types.end()) types.push_back(replay_events[pos].type);
+	}
+	report << "input      count   mean us    p50 us    p95 us    max us\n";
+	for(unsigned int type = 0; type < types.size(); type++) {
+		std::vector<long long> times;
+		long long total = 0;
+		for(unsigned int pos = 0; pos < replay_events.size(); pos++) {
+			if(replay_events[pos].type != types[type]) continue;
+			times.push_back(replay_events[pos].time);
+			total += replay_events[pos].time;
+		}
+		std::sort(times.begin(), times.end());
+		long long p95 = times[((times.size() - 1) * 95) / 100];
+		char line[128];
+		snprintf(line, sizeof(line), "%-10s %5zu %9lld %9lld %9lld %9lld\n", types[type].c_str(), times.size(), total / (long long) times.size(),
+			times[(times.size() - 1) / 2], p95, times.back());
+		report << line;
+		if(replay_budget > 0 && p95 > replay_budget) {
+			report << "FAIL: 95% of " << types[type] << " inputs should take at most " << replay_budget << " us\n";
+			replay_exit_code = 1;
+		}
 	}
-	set_size_of_drawingarea(newWidth, imageHeight);
-}
 
-void
-heightField_changed (GtkEntry *entry,
-               gpointer  user_data)
-{
-	std::string val = gtk_entry_get_text(GTK_ENTRY (heightField));
-	bool valid = isNumeric(val);
-	int newHeight;
-	if(valid) {
-		newHeight = stoi(val);
+	char hash[32];
+	snprintf(hash, sizeof(hash), "%016llx", image_hash());
+	report << "image " << imageWidth << "x" << imageHeight << " hash " << hash << "\n";
+	if(replay_expected_hash.length() > 0 && replay_expected_hash != hash) {
+		report << "FAIL: the image hash should be " << replay_expected_hash << "\n";
+		replay_exit_code = 1;
+	}
+
+	std::cout << report.str();
+	if(replay_report_path.length() > 0) {
+		std::ofstream reportfile(replay_report_path, std::ios::out|std::ios::trunc);
+		reportfile << "line       input         us\n";
+		for(unsigned int pos = 0; pos < replay_events.size(); pos++) {
+			char line[128];
+			snprintf(line, sizeof(line), "%-10d %-10s %5lld\n", replay_events[pos].line, replay_events[pos].type.c_str(), replay_events[pos].time);
+			reportfile << line;
+		}
+		reportfile << "\n" << report.str();
 	}
-	set_size_of_drawingarea(imageWidth, newHeight);
 }
 
-void
-sourceColorField_changed (GtkEntry *entry,
-               gpointer  user_data)
-{
-	std::cout << "changed source color" << std::endl;
+gboolean replay_next_event(gpointer user_data) {
+	if(surface == NULL) return TRUE; // The drawing area hasn't been configured yet.
+	if(replay_position >= replay_events.size()) {
+		report_replay();
+		stop_thumbnail_workers();
+		gtk_main_quit();
+		return FALSE;
+	}
+	ReplayEvent &event = replay_events[replay_position++];
+	auto start = std::chrono::steady_clock::now();
+	dispatch_replay_event(event);
+	event.time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	return TRUE;
 }
 
-void
-targetColorField_changed (GtkEntry *entry,
-               gpointer  user_data)
-{
-	std::string sourceColorText = gtk_entry_get_text(GTK_ENTRY (sourceColorField));
-	std::string targetColorText = gtk_entry_get_text(GTK_ENTRY (targetColorField));
-	bool validSourceColor = isNumeric(sourceColorText);
-	bool validTargetColor = isNumeric(targetColorText);
-	if(validSourceColor && validTargetColor) {
-		int sourceColor = stoi(sourceColorText);
-		int targetColor = stoi(targetColorText);
-		for(int pos = 0; pos < 64000; pos++) {
-			if(VGA_screen[pos] == sourceColor) {
-				VGA_screen[pos] = targetColor;
-			}
-		}
-		put_vga_picture_to_screen();
+bool load_replay(const char *filename) {
+	std::ifstream replayfile(filename);
+	if(!replayfile) {
+		std::cout << "Can't read recording " << filename << std::endl;
+		return false;
+	}
+	std::string text;
+	int line = 0;
+	while(std::getline(replayfile, text)) {
+		line++;
+		std::istringstream fields(text);
+		long long timestamp;
+		ReplayEvent event;
+		if(!(fields >> timestamp >> event.type)) continue;
+		fields.get();
+		std::getline(fields, event.values);
+		event.line = line;
+		event.time = 0;
+		replay_events.push_back(event);
 	}
+	replaying = true;
+	return true;
 }
 
 int
 main (int   argc,
       char *argv[])
 {
+	if(argc >= 2 && strcmp(argv[1], "--batch") == 0) {
+		return run_batch(argc, argv);
+	}
+	if(argc >= 2 && strcmp(argv[1], "--delta") == 0) {
+		return run_delta(argc, argv);
+	}
+
+	const char *recordPath = NULL;
+	const char *replayPath = NULL;
+	for(int arg = 1; arg + 1 < argc; arg++) {
+		if(strcmp(argv[arg], "--record") == 0) recordPath = argv[++arg];
+		else if(strcmp(argv[arg], "--replay") == 0) replayPath = argv[++arg];
+		else if(strcmp(argv[arg], "--report") == 0) replay_report_path = argv[++arg];
+		else if(strcmp(argv[arg], "--budget-us") == 0) replay_budget = atoll(argv[++arg]);
+		else if(strcmp(argv[arg], "--expect-hash") == 0) replay_expected_hash = argv[++arg];
+	}
+	if(replayPath != NULL && !load_replay(replayPath)) return 1;
+	if(recordPath != NULL && replayPath == NULL) {
+		record_file.open(recordPath, std::ios::out|std::ios::trunc);
+		if(!record_file.is_open()) {
+			std::cout << "Can't create recording " << recordPath << std::endl;
+			return 1;
+		}
+		record_start_time = g_get_monotonic_time();
+	}
+
 	for(int pos = 0; pos < size_of_interaction_window; pos++)
 	{
 		data[pos] = 0;
 	}
-	for(int pos = 0; pos < 64000; pos++)
-	{
-		VGA_screen[pos] = 0;
-	}
+	new_document(320, 200, "Untitled");
+	bind_document(documents[0].get());
 
 	create_palette_toolbar();
+	build_brush_spans();
+	count_palette_usage();
 
 	// When initializing the window, remember to include the palette toolbar when defining the size!
 	pixbuf = gdk_pixbuf_new_from_data (data, GDK_COLORSPACE_RGB, false, 8, drawingAreaWidth, (drawingAreaHeight + palette_toolbar_height), (drawingAreaWidth * 3), NULL, NULL);
@@ -750,6 +3127,10 @@ main (int   argc,
 
 	gtk_widget_show(root_menu);
 
+	menu_items = gtk_menu_item_new_with_label("New");
+	g_signal_connect (menu_items, "activate", G_CALLBACK (new_menuitem_click), NULL);
+	gtk_menu_append(GTK_MENU (menu), menu_items);
+
 	sprintf(buf, "Open");
 
 	menu_items = gtk_menu_item_new_with_label(buf);
@@ -758,6 +3139,10 @@ main (int   argc,
 
 	gtk_menu_append(GTK_MENU (menu), menu_items);
 
+	menu_items = gtk_menu_item_new_with_label("Browse...");
+	g_signal_connect (menu_items, "activate", G_CALLBACK (browse_menuitem_click), NULL);
+	gtk_menu_append(GTK_MENU (menu), menu_items);
+
 	sprintf(buf, "Save As...");
 
 	menu_items = gtk_menu_item_new_with_label(buf);
@@ -766,6 +3151,14 @@ main (int   argc,
 
 	gtk_menu_append(GTK_MENU (menu), menu_items);
 
+	menu_items = gtk_menu_item_new_with_label("Export Delta Animation...");
+	g_signal_connect (menu_items, "activate", G_CALLBACK (export_delta_menuitem_click), NULL);
+	gtk_menu_append(GTK_MENU (menu), menu_items);
+
+	menu_items = gtk_menu_item_new_with_label("Close");
+	g_signal_connect (menu_items, "activate", G_CALLBACK (close_menuitem_click), NULL);
+	gtk_menu_append(GTK_MENU (menu), menu_items);
+
 	gtk_widget_show(menu_items);
 
 	gtk_menu_item_set_submenu(GTK_MENU_ITEM (root_menu), menu);
@@ -776,6 +3169,96 @@ main (int   argc,
 
 	gtk_menu_shell_append(GTK_MENU_SHELL (menu_bar), root_menu);
 
+	// Edit menu: the drawing and selection tools and the clipboard
+	menu = gtk_menu_new();
+	root_menu = gtk_menu_item_new_with_label("Edit");
+	gtk_widget_show(root_menu);
+
+	drawToolMenuItem = gtk_radio_menu_item_new_with_label(NULL, "Draw");
+	g_signal_connect (drawToolMenuItem, "toggled", G_CALLBACK (tool_toggled), GINT_TO_POINTER (TOOL_DRAW));
+	gtk_menu_append(GTK_MENU (menu), drawToolMenuItem);
+	selectToolMenuItem = gtk_radio_menu_item_new_with_label(gtk_radio_menu_item_get_group(GTK_RADIO_MENU_ITEM (drawToolMenuItem)), "Select");
+	g_signal_connect (selectToolMenuItem, "toggled", G_CALLBACK (tool_toggled), GINT_TO_POINTER (TOOL_SELECT));
+	gtk_menu_append(GTK_MENU (menu), selectToolMenuItem);
+
+	gtk_menu_append(GTK_MENU (menu), gtk_separator_menu_item_new());
+
+	menu_items = gtk_menu_item_new_with_label("Cut");
+	g_signal_connect (menu_items, "activate", G_CALLBACK (cut_menuitem_click), NULL);
+	gtk_menu_append(GTK_MENU (menu), menu_items);
+	menu_items = gtk_menu_item_new_with_label("Copy");
+	g_signal_connect (menu_items, "activate", G_CALLBACK (copy_menuitem_click), NULL);
+	gtk_menu_append(GTK_MENU (menu), menu_items);
+	menu_items = gtk_menu_item_new_with_label("Paste");
+	g_signal_connect (menu_items, "activate", G_CALLBACK (paste_menuitem_click), NULL);
+	gtk_menu_append(GTK_MENU (menu), menu_items);
+	menu_items = gtk_menu_item_new_with_label("Deselect");
+	g_signal_connect (menu_items, "activate", G_CALLBACK (deselect_menuitem_click), NULL);
+	gtk_menu_append(GTK_MENU (menu), menu_items);
+	menu_items = gtk_menu_item_new_with_label("Use Selection as Brush");
+	g_signal_connect (menu_items, "activate", G_CALLBACK (selection_to_brush_menuitem_click), NULL);
+	gtk_menu_append(GTK_MENU (menu), menu_items);
+
+	gtk_menu_item_set_submenu(GTK_MENU_ITEM (root_menu), menu);
+	gtk_menu_shell_append(GTK_MENU_SHELL (menu_bar), root_menu);
+
+	// Brush menu: the shape and the fill pattern of the brush
+	menu = gtk_menu_new();
+	root_menu = gtk_menu_item_new_with_label("Brush");
+	gtk_widget_show(root_menu);
+
+	const char *brush_shape_names[] = { "Round", "Square", "Custom" };
+	GSList *group = NULL;
+	for(int shape = BRUSH_SHAPE_ROUND; shape <= BRUSH_SHAPE_STAMP; shape++) {
+		menu_items = gtk_radio_menu_item_new_with_label(group, brush_shape_names[shape - BRUSH_SHAPE_ROUND]);
+		group = gtk_radio_menu_item_get_group(GTK_RADIO_MENU_ITEM (menu_items));
+		g_signal_connect (menu_items, "toggled", G_CALLBACK (brush_shape_toggled), GINT_TO_POINTER (shape));
+		gtk_menu_append(GTK_MENU (menu), menu_items);
+		brushShapeMenuItems[shape - BRUSH_SHAPE_ROUND] = menu_items;
+	}
+
+	gtk_menu_append(GTK_MENU (menu), gtk_separator_menu_item_new());
+
+	const char *brush_pattern_names[number_of_brush_patterns] = { "Solid", "Checkerboard", "Horizontal lines", "Vertical lines", "Diagonal lines", "Sparse dots" };
+	group = NULL;
+	for(int pattern = 0; pattern < number_of_brush_patterns; pattern++) {
+		menu_items = gtk_radio_menu_item_new_with_label(group, brush_pattern_names[pattern]);
+		group = gtk_radio_menu_item_get_group(GTK_RADIO_MENU_ITEM (menu_items));
+		g_signal_connect (menu_items, "toggled", G_CALLBACK (brush_pattern_toggled), GINT_TO_POINTER (pattern));
+		gtk_menu_append(GTK_MENU (menu), menu_items);
+		brushPatternMenuItems[pattern] = menu_items;
+	}
+
+	gtk_menu_item_set_submenu(GTK_MENU_ITEM (root_menu), menu);
+	gtk_menu_shell_append(GTK_MENU_SHELL (menu_bar), root_menu);
+
+	// Palette menu
+	menu = gtk_menu_new();
+	root_menu = gtk_menu_item_new_with_label("Palette");
+	gtk_widget_show(root_menu);
+
+	menu_items = gtk_menu_item_new_with_label("Usage...");
+	g_signal_connect (menu_items, "activate", G_CALLBACK (histogram_menuitem_click), NULL);
+	gtk_menu_append(GTK_MENU (menu), menu_items);
+
+	gtk_menu_item_set_submenu(GTK_MENU_ITEM (root_menu), menu);
+	gtk_menu_shell_append(GTK_MENU_SHELL (menu_bar), root_menu);
+
+	// Transform menu: works on the selection, or on the whole image if nothing is selected
+	menu = gtk_menu_new();
+	root_menu = gtk_menu_item_new_with_label("Transform");
+	gtk_widget_show(root_menu);
+
+	const char *transform_names[] = { "Flip Horizontally", "Flip Vertically", "Rotate 90 Clockwise", "Rotate 90 Counterclockwise", "Rotate by Angle", "Scale" };
+	for(int transform = TRANSFORM_FLIP_HORIZONTAL; transform <= TRANSFORM_SCALE; transform++) {
+		menu_items = gtk_menu_item_new_with_label(transform_names[transform - TRANSFORM_FLIP_HORIZONTAL]);
+		g_signal_connect (menu_items, "activate", G_CALLBACK (transform_menuitem_click), GINT_TO_POINTER (transform));
+		gtk_menu_append(GTK_MENU (menu), menu_items);
+	}
+
+	gtk_menu_item_set_submenu(GTK_MENU_ITEM (root_menu), menu);
+	gtk_menu_shell_append(GTK_MENU_SHELL (menu_bar), root_menu);
+
 	da = gtk_drawing_area_new ();
 
 	// When initializing the window, remember to include the palette toolbar when defining the size!
@@ -791,9 +3274,12 @@ main (int   argc,
 		G_CALLBACK (motion_notify_event_cb), NULL);
 	g_signal_connect (da, "button-press-event",
 		G_CALLBACK (button_press_event_cb), NULL);
+	g_signal_connect (da, "button-release-event",
+		G_CALLBACK (button_release_event_cb), NULL);
 
 	gtk_widget_set_events (da, gtk_widget_get_events (da)
 		| GDK_BUTTON_PRESS_MASK
+		| GDK_BUTTON_RELEASE_MASK
 		| GDK_POINTER_MOTION_MASK);
 
 	slider = gtk_scale_new_with_range (GTK_ORIENTATION_HORIZONTAL, 0, 63, 1);
@@ -856,16 +3342,46 @@ main (int   argc,
 	g_signal_connect (targetColorField, "activate",
 		G_CALLBACK (targetColorField_changed), NULL);
 
+	// Text entry field for brush size (1 ... max_brush_size)
+	brushSizeField = gtk_entry_new ();
+	gtk_entry_set_width_chars(GTK_ENTRY (brushSizeField), 5);
+	gtk_widget_set_halign(brushSizeField, GTK_ALIGN_START);
+	gtk_grid_attach (GTK_GRID (grid), brushSizeField, 0, 9, 1, 1);
+	g_signal_connect (brushSizeField, "activate",
+		G_CALLBACK (brushSizeField_changed), NULL);
+
+	// Text entry field for the transparent color of the custom brush
+	transparentColorField = gtk_entry_new ();
+	gtk_entry_set_width_chars(GTK_ENTRY (transparentColorField), 5);
+	gtk_widget_set_halign(transparentColorField, GTK_ALIGN_START);
+	gtk_grid_attach (GTK_GRID (grid), transparentColorField, 0, 10, 1, 1);
+	g_signal_connect (transparentColorField, "activate",
+		G_CALLBACK (transparentColorField_changed), NULL);
+
+	// Text entry field for the angle or the new size used by the Transform menu
+	transformField = gtk_entry_new ();
+	gtk_entry_set_width_chars(GTK_ENTRY (transformField), 9);
+	gtk_widget_set_halign(transformField, GTK_ALIGN_START);
+	gtk_grid_attach (GTK_GRID (grid), transformField, 0, 11, 1, 1);
+
+	// Drop-down list of the open documents
+	documentSelector = gtk_combo_box_text_new ();
+	gtk_widget_set_halign(documentSelector, GTK_ALIGN_START);
+	gtk_grid_attach (GTK_GRID (grid), documentSelector, 0, 12, 1, 1);
+	for(unsigned int doc = 0; doc < documents.size(); doc++) {
+		gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT (documentSelector), documents[doc]->name.c_str());
+	}
+	gtk_combo_box_set_active(GTK_COMBO_BOX (documentSelector), 0);
+	g_signal_connect (documentSelector, "changed",
+		G_CALLBACK (documentSelector_changed), NULL);
+
 	gtk_widget_show_all (window);
 
-	int colorR = VGA_palette_registers[(brush1_color * 3) + 0];
-	int colorG = VGA_palette_registers[(brush1_color * 3) + 1];
-	int colorB = VGA_palette_registers[(brush1_color * 3) + 2];
-	gtk_range_set_value(GTK_RANGE (slider), (colorR / 4));
-	gtk_range_set_value(GTK_RANGE (slider2), (colorG / 4));
-	gtk_range_set_value(GTK_RANGE (slider3), (colorB / 4));
+	set_sliders_to_color(brush1_color);
+
+	if(replaying) g_idle_add(replay_next_event, NULL);
 
 	gtk_main ();
 
-	return 0;
+	return replay_exit_code;
 }